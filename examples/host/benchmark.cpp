@@ -0,0 +1,386 @@
+/*
+ * Microbenchmarks of the runtime hot paths on a Linux/POSIX host.
+ * Prints ns/op (best of several runs), pool blocks obtained per op,
+ * reference count changes per op and arena bytes carved per op (first run,
+ * when the pools are still cold).
+ *
+ * Build and run, for promise_min.hpp and promise_full.hpp. The timers are
+ * measured for both backends of pm_timer, benchmark_timers.cpp is built once
+ * with the sorted list and once with PM_TIMER_WHEEL --
+ *     g++ -std=c++14 -O2 -I../../promise -c benchmark_timers.cpp -o timers_list.o
+ *     g++ -std=c++14 -O2 -I../../promise -DPM_TIMER_WHEEL -c benchmark_timers.cpp -o timers_wheel.o
+ *     g++ -std=c++14 -O2 -pthread -I../../promise benchmark.cpp timers_list.o timers_wheel.o -o benchmark_min
+ *     g++ -std=c++14 -O2 -pthread -I../../promise -DPM_POSIX_FULL benchmark.cpp timers_list.o timers_wheel.o -o benchmark_full
+ *     ./benchmark_min; ./benchmark_full
+ *
+ * Configuration macros such as PM_PRIORITY_LEVELS or PM_COMPACT_PTR can be
+ * added to compare builds.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#define PM_EMBED_STACK  (480 * 1024)    /* Keeps 16 bits offsets on 64 bits hosts */
+#include "posix.hpp"
+#include "benchmark.hpp"
+
+using namespace promise;
+
+extern "C" {
+uint32_t g_alloc_size = 0;
+uint32_t g_stack_size = 0;
+uint32_t g_promise_call_len = 0;
+}
+
+enum {
+    IRQ_CONSUMER    = 1,
+    IRQ_DRAIN       = 2
+};
+
+/* Build a chain of then() on a pending promise */
+static void bench_chain(uint32_t length){
+    Defer head, tail;
+    char name[64];
+    snprintf(name, sizeof(name), "then() chain build, N=%u", length);
+    bench(name, length, [&](){
+        head = newPromise([](Defer){});
+        tail = head;
+    }, [&](){
+        for(uint32_t i = 0; i < length; ++i)
+            tail = tail.then(nothing);
+    }, [&](){
+        head.resolve();
+        head.clear();
+        tail.clear();
+    });
+}
+
+/* Resolve a chain built in advance, per continuation */
+static void bench_resolve(uint32_t length){
+    Defer head;
+    char name[64];
+    snprintf(name, sizeof(name), "resolve() chain, N=%u", length);
+    bench(name, length, [&](){
+        head = newPromise([](Defer){});
+        Defer tail = head;
+        for(uint32_t i = 0; i < length; ++i)
+            tail = tail.then(nothing);
+    }, [&](){
+        head.resolve();
+    }, [&](){
+        head.clear();
+    });
+}
+
+/* A continuation returns the tail of a pending chain of N, which is spliced in */
+static void bench_splice(uint32_t length, uint32_t chains){
+    std::vector<Defer> heads, tails;
+    char name[64];
+    snprintf(name, sizeof(name), "splice returned chain, N=%u", length);
+    bench(name, chains, [&](){
+        for(uint32_t i = 0; i < chains; ++i){
+            Defer head = newPromise([](Defer){});
+            Defer tail = head;
+            for(uint32_t j = 0; j < length; ++j)
+                tail = tail.then(nothing);
+            heads.push_back(head);
+            tails.push_back(tail);
+        }
+    }, [&](){
+        for(uint32_t i = 0; i < chains; ++i){
+            Defer tail = tails[i];
+            resolve().then([tail](){ return tail; });
+        }
+    }, [&](){
+        for(uint32_t i = 0; i < chains; ++i)
+            heads[i].resolve();
+        heads.clear();
+        tails.clear();
+    });
+}
+
+/* find_pending() on the tail of a pending chain of N */
+static void bench_find_pending(uint32_t length){
+    enum { CALLS = 1000 };
+    Defer head, tail;
+    char name[64];
+    snprintf(name, sizeof(name), "find_pending(), N=%u", length);
+    bench(name, CALLS, [&](){
+        head = newPromise([](Defer){});
+        tail = head;
+        for(uint32_t i = 0; i < length; ++i)
+            tail = tail.then(nothing);
+    }, [&](){
+        for(uint32_t i = 0; i < CALLS; ++i)
+            tail.find_pending();
+    }, [&](){
+        head.resolve();
+        head.clear();
+        tail.clear();
+    });
+}
+
+/* doWhile resolved in place, per iteration */
+static void bench_do_while(uint32_t count){
+    uint32_t i = 0;
+    bench("doWhile(), resolved in place", count, [&](){
+        i = 0;
+    }, [&](){
+        doWhile([&](Defer d){
+            if(++i < count) d.resolve();
+            else d.reject();
+        });
+    }, nothing);
+}
+
+/* doWhile with yield(), one pm_run() per iteration */
+static void bench_do_while_yield(uint32_t count){
+    uint32_t i = 0;
+    bench("doWhile() + yield() + pm_run()", count, [&](){
+        i = 0;
+    }, [&](){
+        doWhile([&](Defer d){
+            if(++i < count) yield().then(d);
+            else d.reject();
+        });
+        while(i < count)
+            pm_run();
+    }, nothing);
+}
+
+/* doLoop resolved in place, per iteration */
+static void bench_do_loop(uint32_t count){
+    uint32_t i = 0;
+    bench("doLoop(), resolved in place", count, [&](){
+        i = 0;
+    }, [&](){
+        doLoop([&](Defer d){
+            if(++i < count) d.resolve();
+            else d.reject();
+        });
+    }, nothing);
+}
+
+/* doLoop with yield(), one pm_run() per iteration */
+static void bench_do_loop_yield(uint32_t count){
+    uint32_t i = 0;
+    bench("doLoop() + yield() + pm_run()", count, [&](){
+        i = 0;
+    }, [&](){
+        doLoop([&](Defer d){
+            if(++i < count) yield().then(d);
+            else d.reject();
+        });
+        while(i < count)
+            pm_run();
+    }, nothing);
+}
+
+#ifdef PM_POSIX_FULL
+struct small_payload {
+    int32_t a;
+    float b;
+};
+
+struct large_payload {
+    uint8_t data[64];
+};
+
+/* A value passed through a chain of N then(), per continuation, through
+   pm_any and through TypedDefer */
+template <typename T>
+static void bench_value(const char *type, uint32_t length){
+    char name[64];
+    T value = T();
+    Defer head;
+    snprintf(name, sizeof(name), "pm_any %s, N=%u", type, length);
+    bench(name, length, [&](){
+        head = newPromise([](Defer){});
+        Defer tail = head;
+        for(uint32_t i = 0; i < length; ++i)
+            tail = tail.then([](const T &value){ return value; });
+    }, [&](){
+        head.resolve(value);
+    }, [&](){
+        head.clear();
+    });
+
+    TypedDefer<T> typed_head;
+    snprintf(name, sizeof(name), "TypedDefer %s, N=%u", type, length);
+    bench(name, length, [&](){
+        typed_head = newTypedPromise<T>([](TypedDefer<T>){});
+        TypedDefer<T> tail = typed_head;
+        for(uint32_t i = 0; i < length; ++i)
+            tail = tail.then([](const T &value){ return value; });
+    }, [&](){
+        typed_head.resolve(value);
+    }, [&](){
+        typed_head.clear();
+    });
+}
+
+/* A payload which counts how many times it is copied and moved */
+struct counted_payload {
+    static uint32_t copies_;
+    static uint32_t moves_;
+    uint8_t data_[256];
+
+    counted_payload()
+        : data_() {
+    }
+    counted_payload(const counted_payload &other){
+        memcpy(data_, other.data_, sizeof(data_));
+        ++copies_;
+    }
+    counted_payload(counted_payload &&other){
+        memcpy(data_, other.data_, sizeof(data_));
+        ++moves_;
+    }
+    counted_payload &operator=(const counted_payload &other){
+        memcpy(data_, other.data_, sizeof(data_));
+        ++copies_;
+        return *this;
+    }
+    counted_payload &operator=(counted_payload &&other){
+        memcpy(data_, other.data_, sizeof(data_));
+        ++moves_;
+        return *this;
+    }
+};
+
+uint32_t counted_payload::copies_ = 0;
+uint32_t counted_payload::moves_ = 0;
+
+/* A payload resolved at the head of a chain of N steps, made by step(tail).
+   Copies and moves per step are counted in the first round */
+template <typename STEP>
+static void bench_copies(const char *type, uint32_t length, STEP step){
+    char name[64];
+    Defer head;
+    counted_payload value;
+    uint32_t copies = 0;
+    uint32_t moves = 0;
+    bool first = true;
+    snprintf(name, sizeof(name), "256 bytes %s, N=%u", type, length);
+    bench(name, length, [&](){
+        head = newPromise([](Defer){});
+        Defer tail = head;
+        for(uint32_t i = 0; i < length; ++i)
+            tail = step(tail);
+        counted_payload::copies_ = 0;
+        counted_payload::moves_ = 0;
+    }, [&](){
+        head.resolve(value);
+    }, [&](){
+        if(first){
+            copies = counted_payload::copies_;
+            moves = counted_payload::moves_;
+            first = false;
+        }
+        head.clear();
+    });
+    printf("%-32s %8s %10.2f copies/op, %.2f moves/op\n", "", "", (double)copies / length, (double)moves / length);
+}
+#endif
+
+/* irq post() to the continuation, which waits again */
+static void bench_irq(uint32_t count){
+    static uint32_t received;
+    struct consumer {
+        static void wait(){
+            newPromise([](Defer d){
+                irq_disable();
+                irq<IRQ_CONSUMER>::wait(d);
+                irq_enable();
+            }).then([](){
+                ++received;
+                consumer::wait();
+            });
+        }
+    };
+    consumer::wait();
+
+    bench("irq post() to continuation", count, [&](){
+        received = 0;
+    }, [&](){
+        for(uint32_t i = 0; i < count; ++i){
+            irq<IRQ_CONSUMER>::post();
+            pm_run();
+        }
+    }, nothing);
+}
+
+/* Ready list drained by pm_run(), per promise */
+static void bench_drain(uint32_t count){
+    char name[64];
+    snprintf(name, sizeof(name), "ready list drain, N=%u", count);
+    bench(name, count, [&](){
+        for(uint32_t i = 0; i < count; ++i){
+            newPromise([](Defer d){
+                irq_disable();
+                irq<IRQ_DRAIN>::wait(d);
+                irq_enable();
+            }).then(nothing);
+        }
+        /* One post() for each waiting promise with PM_IRQ_COUNTING */
+        for(uint32_t i = 0; i < count; ++i)
+            irq<IRQ_DRAIN>::post();
+        irq_x::run();
+    }, [&](){
+        pm_run();
+    }, nothing);
+}
+
+int main(){
+#ifdef PM_POSIX_FULL
+    printf("promise_full.hpp, sizeof(Promise) = %u, sizeof(pm_any) = %u\n", (unsigned)sizeof(Promise), (unsigned)sizeof(pm_any));
+#else
+    printf("promise_min.hpp, sizeof(Promise) = %u\n", (unsigned)sizeof(Promise));
+#endif
+    printf("sizeof(Defer) = %u, sizeof(TimerPromise) = %u, sizeof(pm_list) = %u, sizeof(pm_stack::itr_t) = %u\n",
+        (unsigned)sizeof(Defer), (unsigned)sizeof(TimerPromise), (unsigned)sizeof(pm_list), (unsigned)sizeof(pm_stack::itr_t));
+    printf("%-32s %8s %10s %10s %10s %10s\n", "workload", "ops", "ns/op", "allocs/op", "refs/op", "arena B/op");
+
+    bench_chain(10);
+    bench_chain(1000);
+    bench_resolve(10);
+    bench_resolve(1000);
+    bench_do_while(200);
+    bench_do_while_yield(10000);
+    bench_do_while_yield(1000000);
+    bench_do_loop(200);
+    bench_do_loop(10000);
+    bench_do_loop_yield(10000);
+    bench_splice(5, 200);
+    bench_splice(500, 2);
+    bench_find_pending(10);
+    bench_find_pending(1000);
+#ifdef PM_POSIX_FULL
+    bench_value<int32_t>("int", 10);
+    bench_value<small_payload>("8 bytes struct", 10);
+    bench_value<large_payload>("64 bytes struct", 10);
+    bench_copies("then() by value", 10, [](Defer &tail){
+        return tail.then([](counted_payload value){ return value; });
+    });
+    bench_copies("then() by const &", 10, [](Defer &tail){
+        return tail.then([](const counted_payload &value){ return value; });
+    });
+    bench_copies("through fail()", 10, [](Defer &tail){
+        return tail.fail([](){});
+    });
+    bench_copies("through finally()", 10, [](Defer &tail){
+        return tail.finally([](){});
+    });
+#endif
+    bench_timers_list();
+    bench_timers_wheel();
+    bench_irq(10000);
+    bench_drain(1000);
+
+    printf("\n");
+    pm_allocator::dump([](const char *str){ fputs(str, stdout); });
+    return 0;
+}
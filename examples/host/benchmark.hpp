@@ -0,0 +1,57 @@
+/*
+ * Measurement loop shared by benchmark.cpp and benchmark_timers.cpp, include
+ * it after posix.hpp.
+ */
+#pragma once
+#ifndef INC_BENCHMARK_HPP_
+#define INC_BENCHMARK_HPP_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+
+enum {
+    REPEAT          = 7
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+/* Only run() is measured, setup() and teardown() prepare and clean up each round */
+template <typename SETUP, typename RUN, typename TEARDOWN>
+static void bench(const char *name, uint32_t ops, SETUP setup, RUN run, TEARDOWN teardown){
+    double best_ns = 0;
+    double obtains = 0;
+    double refs = 0;
+    double arena = 0;
+
+    for(int i = 0; i < REPEAT; ++i){
+        setup();
+        uint32_t obtain_count = promise::pm_allocator::obtain_count();
+        uint32_t ref_count_ops = promise::pm_allocator::ref_count_ops();
+        uint32_t stack_size = g_stack_size;
+        bench_clock::time_point start = bench_clock::now();
+        run();
+        bench_clock::time_point end = bench_clock::now();
+        if(i == 0){
+            obtains = (double)(promise::pm_allocator::obtain_count() - obtain_count) / ops;
+            refs = (double)(promise::pm_allocator::ref_count_ops() - ref_count_ops) / ops;
+            arena = (double)(g_stack_size - stack_size) / ops;
+        }
+        teardown();
+
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / ops;
+        if(i == 0 || ns < best_ns)
+            best_ns = ns;
+    }
+
+    printf("%-32s %8u %10.1f %10.2f %10.2f %10.1f\n", name, ops, best_ns, obtains, refs, arena);
+}
+
+static void nothing(){
+}
+
+/* Timers among 10 to 10000 others, for each backend of pm_timer */
+void bench_timers_list();
+void bench_timers_wheel();
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Timers of benchmark.cpp, for one backend of pm_timer. Built once as is for
+ * the sorted list, and once with PM_TIMER_WHEEL, both are linked into
+ * benchmark_min and benchmark_full (see benchmark.cpp).
+ *
+ * Each build puts the library in its own namespace, so the two pm_timer
+ * classes and their arenas do not clash with each other or with benchmark.cpp.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+#ifdef PM_TIMER_WHEEL
+#define promise         pm_bench_wheel
+#define BENCH_TIMERS    bench_timers_wheel
+#define BENCH_BACKEND   "timing wheel (PM_TIMER_WHEEL)"
+#else
+#define promise         pm_bench_list
+#define BENCH_TIMERS    bench_timers_list
+#define BENCH_BACKEND   "sorted list"
+#endif
+
+#define PM_EMBED_STACK  (2 * 1024 * 1024)   /* 10100 timers are armed at once */
+#include "posix.hpp"
+#include "benchmark.hpp"
+
+using namespace promise;
+
+/* Timers armed among a population of other timers */
+static void bench_timers(uint32_t population, uint32_t count){
+    std::vector<Defer> others;
+    std::vector<Defer> timers;
+    char name[64];
+    srand(1);
+
+    auto arm_others = [&](){
+        for(uint32_t i = 0; i < population; ++i)
+            others.push_back(delay_ticks(100000 + rand() % (population * 16 + 1)));
+    };
+    auto kill_all = [&](){
+        for(size_t i = 0; i < timers.size(); ++i)
+            kill_timer(timers[i]);
+        for(size_t i = 0; i < others.size(); ++i)
+            kill_timer(others[i]);
+        timers.clear();
+        others.clear();
+        pm_run();
+    };
+
+    snprintf(name, sizeof(name), "delay_ticks() arm, %u timers", population);
+    bench(name, count, arm_others, [&](){
+        for(uint32_t i = 0; i < count; ++i)
+            timers.push_back(delay_ticks(100000 + rand() % (population * 16 + 1)));
+    }, kill_all);
+
+    snprintf(name, sizeof(name), "kill_timer(), %u timers", population);
+    bench(name, count, [&](){
+        arm_others();
+        for(uint32_t i = 0; i < count; ++i)
+            timers.push_back(delay_ticks(100000 + rand() % (population * 16 + 1)));
+    }, [&](){
+        for(uint32_t i = 0; i < count; ++i)
+            kill_timer(timers[i]);
+    }, kill_all);
+
+    snprintf(name, sizeof(name), "timer expire+run, %u timers", population);
+    bench(name, count, [&](){
+        arm_others();
+        for(uint32_t i = 0; i < count; ++i)
+            delay_ticks(1 + i % 16).then(nothing);
+    }, [&](){
+        for(uint32_t tick = 0; tick < 16; ++tick){
+            pm_timer::increase_ticks();
+            pm_run();
+        }
+    }, kill_all);
+}
+
+void BENCH_TIMERS(){
+    printf("timers in a %s\n", BENCH_BACKEND);
+    bench_timers(10, 100);
+    bench_timers(100, 100);
+    bench_timers(1000, 100);
+    bench_timers(10000, 100);
+}
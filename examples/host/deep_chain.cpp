@@ -0,0 +1,121 @@
+/*
+ * Stack used to resolve long synchronous chains. Each chain is built, resolved
+ * and released on a thread with a fixed stack budget, and the stack high-water
+ * mark is printed. It must not grow with the length of the chain.
+ *     g++ -std=c++11 -O2 -pthread -I../../promise deep_chain.cpp -o deep_chain
+ *     ./deep_chain
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define PM_EMBED_STACK  (4 * 1024 * 1024)   /* 10000 steps are pending at once */
+#include "posix.hpp"
+
+using namespace promise;
+
+extern "C" {
+uint32_t g_alloc_size = 0;
+uint32_t g_stack_size = 0;
+uint32_t g_promise_call_len = 0;
+}
+
+enum {
+    STACK_BUDGET    = 64 * 1024,    /* Stack of the thread running a chain */
+    PAINT           = 0xA5
+};
+
+static uint32_t g_steps;
+
+/* then() on a pending promise, resolved at once */
+static void chain_resolve(uint32_t length){
+    Defer head = newPromise([](Defer){});
+    Defer tail = head;
+    for(uint32_t i = 0; i < length; ++i)
+        tail = tail.then([](){ ++g_steps; });
+    head.resolve();
+}
+
+/* Each step returns a promise which is resolved already */
+static void chain_return(uint32_t length){
+    Defer head = newPromise([](Defer){});
+    Defer tail = head;
+    for(uint32_t i = 0; i < length; ++i)
+        tail = tail.then([]()->Defer { ++g_steps; return resolve(); });
+    head.resolve();
+}
+
+/* The rejection passes every then() to the fail() at the end */
+static void chain_reject(uint32_t length){
+    Defer head = newPromise([](Defer){});
+    Defer tail = head;
+    for(uint32_t i = 1; i < length; ++i)
+        tail = tail.then([](){ ++g_steps; });
+    tail.fail([](){ ++g_steps; });
+    head.reject();
+}
+
+struct chain_case {
+    void (*run)(uint32_t length);
+    uint32_t length;
+};
+
+static void *chain_thread(void *arg){
+    chain_case *c = (chain_case *)arg;
+    c->run(c->length);
+    return nullptr;
+}
+
+/* Run the chain on a painted stack with a guard page below it,
+   return the bytes of stack used */
+static size_t run_on_stack(void (*run)(uint32_t), uint32_t length){
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    unsigned char *mem = (unsigned char *)mmap(nullptr, STACK_BUDGET + page, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    mprotect(mem, page, PROT_NONE);
+    unsigned char *stack = mem + page;
+    memset(stack, PAINT, STACK_BUDGET);
+
+    chain_case c = { run, length };
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, stack, STACK_BUDGET);
+    pthread_t thread;
+    pthread_create(&thread, &attr, chain_thread, &c);
+    pthread_join(thread, nullptr);
+    pthread_attr_destroy(&attr);
+
+    size_t untouched = 0;
+    while(untouched < STACK_BUDGET && stack[untouched] == PAINT)
+        ++untouched;
+    munmap(mem, STACK_BUDGET + page);
+    return STACK_BUDGET - untouched;
+}
+
+int main(){
+    static const struct {
+        const char *name;
+        void (*run)(uint32_t);
+    } cases[] = {
+        { "then() chain", chain_resolve },
+        { "returned promises", chain_return },
+        { "rejection to fail()", chain_reject }
+    };
+    static const uint32_t lengths[] = { 10, 100, 1000, 10000 };
+
+    printf("stack budget %u bytes\n", (unsigned)STACK_BUDGET);
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i){
+        for(size_t j = 0; j < sizeof(lengths) / sizeof(lengths[0]); ++j){
+            g_steps = 0;
+            size_t used = run_on_stack(cases[i].run, lengths[j]);
+            printf("%-24s %6u steps, %6u run, stack used %6u\n", cases[i].name,
+                lengths[j], g_steps, (unsigned)used);
+            fflush(stdout);
+        }
+    }
+    printf("arena used %u\n", g_stack_size);
+    return 0;
+}
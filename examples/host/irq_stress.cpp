@@ -0,0 +1,111 @@
+/*
+ * Stress test of counting irq events (PM_IRQ_COUNTING) on a Linux/POSIX host.
+ * Threads stand in for the ISRs and post two irqs through pm_posix::interrupt()
+ * as fast as they can, while the main loop consumes them with several promises
+ * waiting on each irq. No post() may be lost or counted twice -- the test
+ * fails unless every irq is consumed exactly as many times as it was posted.
+ *
+ * Build and run --
+ *     g++ -std=c++11 -O2 -pthread -I../../promise irq_stress.cpp -o irq_stress
+ *     ./irq_stress
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#ifndef PM_IRQ_COUNTING
+#define PM_IRQ_COUNTING         /* post() with nobody waiting is kept */
+#endif
+#include "posix.hpp"
+
+using namespace promise;
+
+extern "C" {
+uint32_t g_alloc_size = 0;
+uint32_t g_stack_size = 0;
+uint32_t g_promise_call_len = 0;
+}
+
+enum {
+    IRQ_A           = 1,
+    IRQ_B           = 2,
+    POSTERS         = 4,        /* Threads posting, each as an ISR */
+    POSTS           = 200000,   /* post() of each thread */
+    CONSUMERS       = 3         /* Promises waiting on each irq at once */
+};
+
+static std::atomic<uint32_t> g_posted[2];
+static std::atomic<uint32_t> g_finished(0);    /* Posters done, set in their last interrupt */
+static uint32_t g_consumed[2];
+
+/* Wait on the irq again after each event */
+template <int IRQ>
+static void consume(){
+    newPromise([](Defer d){
+        irq<IRQ>::wait(d);
+    }).then([](){
+        ++g_consumed[IRQ - IRQ_A];
+        consume<IRQ>();
+    });
+}
+
+static void poster(uint32_t seed){
+    for(uint32_t i = 0; i < POSTS; ++i){
+        seed = seed * 1103515245 + 12345;
+        bool last = (i + 1 == POSTS);
+        if(seed & 0x10000){
+            pm_posix::interrupt([=](){
+                irq<IRQ_A>::post();
+                ++g_posted[0];
+                if(last) ++g_finished;
+            });
+        }
+        else{
+            pm_posix::interrupt([=](){
+                irq<IRQ_B>::post();
+                ++g_posted[1];
+                if(last) ++g_finished;
+            });
+        }
+    }
+}
+
+int main(){
+    for(int i = 0; i < CONSUMERS; ++i){
+        consume<IRQ_A>();
+        consume<IRQ_B>();
+    }
+
+    std::vector<std::thread> posters;
+    for(uint32_t i = 0; i < POSTERS; ++i)
+        posters.push_back(std::thread(poster, i + 1));
+
+    uint32_t wakeups = 0;
+    while(true){
+        pm_run();
+        if(g_finished.load() == POSTERS
+            && g_consumed[0] == g_posted[0].load() && g_consumed[1] == g_posted[1].load())
+            break;
+        pm_posix::idle();
+        ++wakeups;
+    }
+    for(size_t i = 0; i < posters.size(); ++i)
+        posters[i].join();
+
+    /* Nothing more may be consumed once the posters stopped */
+    pm_run();
+
+    bool ok = true;
+    for(int i = 0; i < 2; ++i){
+        printf("irq %d: posted %u, consumed %u\n", IRQ_A + i, g_posted[i].load(), g_consumed[i]);
+        if(g_posted[i].load() != g_consumed[i])
+            ok = false;
+    }
+    if(g_posted[0].load() + g_posted[1].load() != (uint32_t)POSTERS * POSTS)
+        ok = false;
+    printf("%u posters, %u wakeups, arena used %u\n", (unsigned)POSTERS, wakeups, g_stack_size);
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,142 @@
+/*
+ * Same tasks as examples/M051/main.cpp, running on Linux with posix.hpp.
+ * The LEDs are printed instead, and a thread presses a "button" every
+ * 1.5 seconds through irq<BUTTON_IRQn>. It quits after 10 seconds.
+ *
+ * Build and run --
+ *     g++ -std=c++11 -O2 -pthread -I../../promise main.cpp -o promise_host
+ *     ./promise_host
+ */
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <chrono>
+#include "posix.hpp"
+
+/********************************************/
+/* Functions required by promise library    */
+/********************************************/
+using namespace promise;
+
+extern "C" {
+/* For debug usage */
+uint32_t g_alloc_size = 0;
+uint32_t g_stack_size = 0;
+uint32_t g_promise_call_len = 0;
+}/* extern "C" */
+
+static bool g_quit = false;
+
+void pm_run_loop(){
+    while(!g_quit){
+        pm_run();
+        pm_posix::idle();
+    }
+}
+
+
+/********************************************/
+/* Use defined procedure                    */
+/********************************************/
+enum {
+    BUTTON_IRQn = 1
+};
+
+void print_time(const char *what){
+    uint32_t msec = pm_timer::ticks_to_msec(pm_timer::get_ticks());
+    printf("%5u.%03u %s\n", msec / 1000, msec % 1000, what);
+    fflush(stdout);
+}
+
+inline void LED_A(int on){
+    print_time(on ? "LED A on" : "LED A off");
+}
+
+inline void LED_B(int on){
+    print_time(on ? "LED B on" : "LED B off");
+}
+
+//Blink LED A for count times
+Defer LED_A_blink(int count){
+    if(count <= 0) return delay_ms(0);
+
+    return delay_ms(500)                //Wait 0.5 second
+    .then([]()->Defer {
+        LED_A(1);                       //LED A on
+        return delay_ms(500);           //Wait 0.5 second
+    }).then([=]()->Defer {
+        LED_A(0);                       //LED A off
+        return LED_A_blink(count - 1);  //Blink again
+    });
+
+}
+
+//Blink LED A fast forever
+void LED_A_blink_fast(){
+    delay_ms(200).then([]()->Defer {    //Wait 0.2 second
+        LED_A(1);                       //LED A on
+        return delay_ms(200);           //Wait 0.2 second
+    }).then([](){
+        LED_A(0);                       //LED A off
+        LED_A_blink_fast();             //Blink again
+    });
+}
+
+//Blink LED B fast forever
+void LED_B_blink_fast(){
+    delay_ms(200).then([]()->Defer {    //Wait 0.2 second
+        LED_B(1);                       //LED B on
+        return delay_ms(200);           //Wait 0.2 second
+    }).then([](){
+        LED_B(0);                       //LED B off
+        LED_B_blink_fast();             //Blink again
+    });
+}
+
+//Print each button press
+void on_button(){
+    newPromise([](Defer d){
+        irq_disable();
+        irq<BUTTON_IRQn>::wait(d);
+        irq_enable();
+    }).then([](){
+        print_time("button");
+        on_button();
+    });
+}
+
+
+int main(){
+    pm_timer::init_system(0);
+
+    /* LED A blinks 5 times,
+       then wait 3 seconds,
+       then LED A and LED B blink fast together */
+    LED_A_blink(5).then([](){
+        return delay_s(3);
+    }).then([](){
+        LED_A_blink_fast();
+        LED_B_blink_fast();
+    });
+
+    on_button();
+    delay_s(10).then([](){
+        g_quit = true;
+    });
+
+    /* A thread stands in for the button interrupt */
+    std::thread button([](){
+        while(true){
+            std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+            pm_posix::interrupt([](){
+                irq<BUTTON_IRQn>::post();
+            });
+        }
+    });
+    button.detach();
+
+    /* The blinking runs in pm_run_loop */
+    pm_run_loop();
+    printf("wakeups %u\n", pm_posix::wakeups());
+    return 0;
+}
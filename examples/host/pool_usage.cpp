@@ -0,0 +1,126 @@
+/*
+ * Arena usage of the memory pools for a mixed workload -- tasks with captured
+ * states of many different sizes wait for timers and an irq. They run in
+ * phases, as the features of an application do, and the state sizes of the
+ * phases are interleaved, so near-sized pools peak at different times.
+ * Prints the arena used and the time of each phase, then the pools. Build it
+ * with different size classes or slab pages to compare --
+ *     g++ -std=c++11 -O2 -pthread -I../../promise pool_usage.cpp -o pool_usage
+ *     g++ -std=c++11 -O2 -pthread -I../../promise -DPM_SIZE_CLASS_STEPS=4 pool_usage.cpp -o pool_usage_4
+ *     g++ -std=c++11 -O2 -pthread -I../../promise -DPM_SLAB_PAGE=256 pool_usage.cpp -o pool_usage_slab
+ *     ./pool_usage; ./pool_usage_4; ./pool_usage_slab
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+
+#define PM_EMBED_STACK  (256 * 1024)    /* Keeps 16 bits offsets on 64 bits hosts */
+#include "posix.hpp"
+
+using namespace promise;
+
+extern "C" {
+uint32_t g_alloc_size = 0;
+uint32_t g_stack_size = 0;
+uint32_t g_promise_call_len = 0;
+}
+
+enum {
+    MAX_STATE   = 128,  /* Tasks have 1 to MAX_STATE bytes of state */
+    PHASES      = 4,    /* Phase (N / 8) % PHASES runs the tasks of N bytes */
+    INSTANCES   = 3,    /* Tasks running for each state size */
+    ROUNDS      = 20,   /* Times each task waits */
+    EVENT_IRQn  = 1
+};
+
+static uint32_t g_done = 0;
+static uint32_t g_checksum = 0;
+
+template <size_t N>
+struct task_state {
+    uint8_t data_[N];
+    uint32_t sum() const {
+        uint32_t sum = 0;
+        for(size_t i = 0; i < N; ++i)
+            sum += data_[i];
+        return sum;
+    }
+};
+
+/* Wait for a timer, use the state, and every 4th round wait for the irq too */
+template <size_t N>
+void task(task_state<N> state, uint32_t round){
+    delay_ticks(1 + (N + round) % 5).then([=]()->Defer {
+        g_checksum += state.sum();
+        if(round % 4 != 0)
+            return delay_ticks(0);
+        return newPromise([](Defer d){
+            irq_disable();
+            irq<EVENT_IRQn>::wait(d);
+            irq_enable();
+        });
+    }).then([=](){
+        if(round + 1 < ROUNDS)
+            task<N>(state, round + 1);
+        else
+            ++g_done;
+    }).fail([](){
+        ++g_done;
+    });
+}
+
+template <size_t N>
+struct spawn {
+    static uint32_t run(uint32_t phase){
+        uint32_t tasks = 0;
+        if((N / 8) % PHASES == phase){
+            task_state<N> state;
+            memset(state.data_, (int)N, N);
+            for(int i = 0; i < INSTANCES; ++i)
+                task<N>(state, 0);
+            tasks = INSTANCES;
+        }
+        return tasks + spawn<N - 1>::run(phase);
+    }
+};
+
+template <>
+struct spawn<0> {
+    static uint32_t run(uint32_t){
+        return 0;
+    }
+};
+
+int main(){
+    typedef std::chrono::steady_clock clock;
+    irq<EVENT_IRQn>::init();
+    for(uint32_t phase = 0; phase < PHASES; ++phase){
+        clock::time_point start = clock::now();
+        uint32_t tasks = spawn<MAX_STATE>::run(phase);
+        for(g_done = 0; g_done < tasks; ){
+            pm_timer::increase_ticks();
+            irq<EVENT_IRQn>::post();
+            irq_x::run();
+            pm_run();
+        }
+#ifdef PM_SLAB_PAGE
+        /* The pages of this phase can be used by the next one */
+        pm_allocator::reclaim();
+#endif
+        clock::time_point end = clock::now();
+        printf("phase %u, tasks %u, arena used %u, %u us\n", phase, tasks, g_stack_size,
+            (unsigned)std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+    }
+
+    size_t pools = 0;
+    size_t pool_bytes = 0;
+    pm_allocator::for_each_pool([&](const pm_memory_pool &pool){
+        ++pools;
+        pool_bytes += pool.arena_bytes();
+    });
+    pm_allocator::dump([](const char *str){ fputs(str, stdout); });
+    printf("size classes %u, pools %u, pool arena %u, arena used %u, checksum %u\n",
+        (unsigned)PM_SIZE_CLASS_STEPS, (unsigned)pools, (unsigned)pool_bytes, g_stack_size, g_checksum);
+    return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Wake-to-run latency of a high priority promise under a flood of low
+ * priority work, on a Linux/POSIX host. A thread stands in for the ISR.
+ *
+ * Build and run --
+ *     g++ -std=c++11 -O2 -pthread -I../../promise priority_latency.cpp -o priority_latency
+ *     ./priority_latency
+ *
+ * Build with -DPM_PRIORITY_LEVELS=1 to compare with the single ready list.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#define PM_IRQ_COUNTING             /* post() does not lock out the main loop */
+#ifndef PM_PRIORITY_LEVELS
+#define PM_PRIORITY_LEVELS  2
+#endif
+#include "posix.hpp"
+
+using namespace promise;
+
+extern "C" {
+uint32_t g_alloc_size = 0;
+uint32_t g_stack_size = 0;
+uint32_t g_promise_call_len = 0;
+}
+
+enum {
+    IRQ_SAMPLE      = 1,
+    LOW_CHAINS      = 64,       /* low priority chains always ready */
+    LOW_WORK_NS     = 2000,     /* busy work of each low priority step */
+    SAMPLES         = 2000
+};
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void busy_ns(uint64_t ns){
+    uint64_t end = now_ns() + ns;
+    while(now_ns() < end);
+}
+
+static std::atomic<uint64_t> g_post_ns(0);
+static std::atomic<bool> g_consumed(true);
+static std::vector<uint64_t> g_latency;
+
+static void low_chain(){
+    yield().then([](){
+        busy_ns(LOW_WORK_NS);
+        low_chain();
+    });
+}
+
+static void high_chain(){
+    newPromise([](Defer d){
+        irq<IRQ_SAMPLE>::wait(d);
+    }, PM_PRIORITY_LEVELS - 1).then([](){
+        g_latency.push_back(now_ns() - g_post_ns.load());
+        g_consumed = true;
+        high_chain();
+    });
+}
+
+int main(){
+    g_latency.reserve(SAMPLES);
+    for(int i = 0; i < LOW_CHAINS; ++i)
+        newPromise([](Defer d){ d.resolve(); }, 0).then(low_chain);
+    high_chain();
+
+    std::thread isr([](){
+        for(int i = 0; i < SAMPLES; ++i){
+            while(!g_consumed.load())
+                std::this_thread::yield();
+            busy_ns(50000 + (i * 7919) % 50000);
+            g_consumed = false;
+            g_post_ns = now_ns();
+            pm_posix::interrupt([](){
+                irq<IRQ_SAMPLE>::post();
+            });
+        }
+    });
+
+    while(g_latency.size() < SAMPLES)
+        pm_run();
+    isr.join();
+
+    std::sort(g_latency.begin(), g_latency.end());
+    uint64_t sum = 0;
+    for(size_t i = 0; i < g_latency.size(); ++i)
+        sum += g_latency[i];
+    printf("PM_PRIORITY_LEVELS=%d, %d low priority chains of %dus each\n",
+        PM_PRIORITY_LEVELS, (int)LOW_CHAINS, (int)LOW_WORK_NS / 1000);
+    printf("wake-to-run latency (us): mean %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+        sum / 1000.0 / g_latency.size(),
+        g_latency[g_latency.size() / 2] / 1000.0,
+        g_latency[g_latency.size() * 99 / 100] / 1000.0,
+        g_latency.back() / 1000.0);
+    return 0;
+}
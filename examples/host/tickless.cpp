@@ -0,0 +1,110 @@
+/*
+ * Tickless idle on Linux. The same timers run twice, first with the periodic
+ * tick and pm_posix::idle(), then through pm_idle<pm_posix>(pm_posix::wait),
+ * which stops the tick thread until the next timer expires. Prints the
+ * wakeups of each loop and when each timer fired, and fails if the tickless
+ * loop does not wake up far less often, if a timer fires before its deadline
+ * tick, or far later than its deadline. Lateness depends on host scheduling,
+ * so it is only bounded loosely.
+ *
+ * Build and run --
+ *     g++ -std=c++11 -O2 -pthread -I../../promise tickless.cpp -o tickless
+ *     ./tickless
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#include "posix.hpp"
+
+using namespace promise;
+
+extern "C" {
+uint32_t g_alloc_size = 0;
+uint32_t g_stack_size = 0;
+uint32_t g_promise_call_len = 0;
+}
+
+enum {
+    TIMERS          = 5,
+    LATE_MS         = 200,  /* Host scheduling, in ticks and in wall clock */
+    WAKEUP_RATIO    = 10    /* The tickless loop wakes up at least this many times less */
+};
+
+static const uint32_t g_delays_ms[TIMERS] = { 50, 130, 260, 500, 750 };
+
+typedef std::chrono::steady_clock host_clock;
+
+struct timer_result {
+    uint32_t deadline_ticks_;
+    uint32_t fired_ticks_;
+    host_clock::time_point deadline_;
+    host_clock::time_point fired_;
+};
+
+static timer_result g_results[TIMERS];
+static uint32_t g_fired;
+
+/* Start the timers, and return the wakeups of the loop until all of them fired */
+template <typename IDLE>
+static uint32_t run_timers(const char *mode, IDLE idle){
+    g_fired = 0;
+    host_clock::time_point start = host_clock::now();
+    for(int i = 0; i < TIMERS; ++i){
+        g_results[i].deadline_ticks_ = pm_timer::get_ticks() + pm_timer::msec_to_ticks(g_delays_ms[i]);
+        g_results[i].deadline_ = start + std::chrono::milliseconds(g_delays_ms[i]);
+        delay_ms(g_delays_ms[i]).then([=](){
+            g_results[i].fired_ticks_ = pm_timer::get_ticks();
+            g_results[i].fired_ = host_clock::now();
+            ++g_fired;
+        });
+    }
+
+    uint32_t wakeups = pm_posix::wakeups();
+    while(true){
+        pm_run();
+        if(g_fired == TIMERS) break;    /* Else idle() with no timer waits for an interrupt */
+        idle();
+    }
+    wakeups = pm_posix::wakeups() - wakeups;
+    printf("%-9s wakeups %u\n", mode, wakeups);
+    return wakeups;
+}
+
+/* Each timer fired at or after its deadline tick, and not far later */
+static int check_deadlines(const char *mode){
+    int bad = 0;
+    for(int i = 0; i < TIMERS; ++i){
+        const timer_result &result = g_results[i];
+        int32_t late_ticks = (int32_t)(result.fired_ticks_ - result.deadline_ticks_);
+        long long error_us = (long long)std::chrono::duration_cast<std::chrono::microseconds>(
+            result.fired_ - result.deadline_).count();
+        bool ok = (late_ticks >= 0 && late_ticks <= (int32_t)pm_timer::msec_to_ticks(LATE_MS)
+            && error_us <= LATE_MS * 1000);
+        printf("%-9s timer %4u ms fired %+4d ticks %+8.3f ms%s\n", mode, g_delays_ms[i],
+            (int)late_ticks, (double)error_us / 1000, ok ? "" : "  <- FAIL");
+        if(!ok) ++bad;
+    }
+    return bad;
+}
+
+int main(){
+    pm_timer::init_system(0);
+
+    uint32_t periodic = run_timers("periodic", [](){
+        pm_posix::idle();
+    });
+    int bad = check_deadlines("periodic");
+
+    uint32_t tickless = run_timers("tickless", [](){
+        pm_idle<pm_posix>(pm_posix::wait);
+    });
+    bad += check_deadlines("tickless");
+
+    if(tickless * WAKEUP_RATIO > periodic){
+        printf("tickless wakeups %u, not %u times less than %u\n", tickless, (unsigned)WAKEUP_RATIO, periodic);
+        ++bad;
+    }
+
+    printf("%s\n", bad == 0 ? "PASS" : "FAIL");
+    return bad == 0 ? 0 : 1;
+}
@@ -4,10 +4,39 @@
 
 namespace promise{
 
+/* Statistics of pm_run_for() */
+struct pm_run_stats{
+    uint32_t runs_;         /* Times pm_run_for() was called */
+    uint32_t callbacks_;    /* Promises resolved by pm_run_for() */
+    uint32_t overruns_;     /* Times the budget ran out before the snapshot was drained */
+    uint32_t last_depth_;   /* Ready promises in the last snapshot */
+    uint32_t max_depth_;    /* Maximum of last_depth_ */
+    uint32_t max_ticks_;    /* Longest pm_run_for() in ticks */
+    pm_run_stats()
+        : runs_(0)
+        , callbacks_(0)
+        , overruns_(0)
+        , last_depth_(0)
+        , max_depth_(0)
+        , max_ticks_(0){
+    }
+};
+
+/* Promises are linked by Promise::list_ with no extra allocation,
+   the list holds a reference of each promise linked.
+   There's one ready list for each priority class, pm_run() resolves
+   the higher ones first. */
 struct defer_list{
+    static inline Promise *from_list(pm_list *node){
+        return pm_container_of(node, &Promise::list_);
+    }
+
     static void attach(pm_list *list, const Defer &defer){
-        Defer *defer_ = pm_new<Defer>(defer);
-        pm_list *node = &pm_memory_pool_buf_header::from_ptr(defer_)->list_;
+        pm_list *node = &defer->list_;
+        if(node->empty())
+            pm_allocator::add_ref(defer.operator->());
+        else
+            node->detach();
         list->attach(node);
     }
 
@@ -16,7 +45,7 @@ struct defer_list{
         if(next != other){
 #ifdef PM_DEBUG
             for(pm_list *node = next; node != other; node = node->next()){
-                pm_memory_pool_buf_header *header = pm_container_of(node, &pm_memory_pool_buf_header::list_);
+                pm_memory_pool_buf_header *header = pm_memory_pool_buf_header::from_ptr(from_list(node));
                 pm_assert(header->ref_count_ > 0);
             }
 #endif
@@ -24,52 +53,183 @@ struct defer_list{
             list->attach(next);
         }
     }
-    
-    static void remove(pm_list *list, const Defer &defer){
-        pm_list *node = list->next();
-        while(node != list){
-            Defer *defer_ = reinterpret_cast<Defer *>(pm_memory_pool_buf_header::to_ptr(node));
-            pm_list *node_next = node->next();
-            
-            if(*defer_ == defer){
-                node->detach();
-                pm_delete(defer_);
-            }
-            node = node_next;
-        }
-    }
 
-    static void run(pm_list *list){
-        while(!list->empty()){
-            pm_list *node = list->next();
-            Defer *defer = reinterpret_cast<Defer *>(pm_memory_pool_buf_header::to_ptr(node));
+    /* Move the promise to the ready list of its priority, the reference goes with it.
+       During a snapshot, a promise of a higher priority than the one run last
+       goes before the marker, so a promise woken by an irq preempts the rest of
+       the snapshot. One of the same or a lower priority waits for the next
+       snapshot, so an irq posted again and again can not keep it running */
+    static inline void ready(pm_list *node){
+        ready_lists *lists = get_lists();
+        uint8_t priority = from_list(node)->priority_;
+        pm_list *marker = &lists->markers_[priority].list_;
+        if(!marker->empty() && priority > lists->running_)
+            marker->move(node);
+        else
+            lists->lists_[priority].list_.move(node);
+    }
+    
+    /* Unlink the promise from whichever list it is in */
+    static void remove(const Defer &defer){
+        pm_list *node = &defer->list_;
+        if(!node->empty()){
             node->detach();
-            Defer defer_ = *defer;
-            pm_delete(defer);
-
-            defer_.resolve();
+            pm_allocator::dec_ref(defer.operator->());
         }
     }
 
     static inline void attach(const Defer &defer){
-        attach(get_list(), defer);
+        attach(get_list(defer->priority_), defer);
     }
     static inline void attach(pm_list *other){
+#if PM_PRIORITY_LEVELS > 1
+        while(!other->empty())
+            ready(other->next());
+#else
         attach(get_list(), other);
+#endif
     }
     static void run(){
-        run(get_list());
+        while(run_one());
+    }
+
+    /* Resolve one promise from the highest priority ready list,
+       return false if all are empty */
+    static bool run_one(){
+        ready_lists *lists = get_lists();
+        for(size_t priority = PM_PRIORITY_LEVELS; priority-- > 0; ){
+            pm_list *node = first(lists, priority);
+            if(node != &lists->lists_[priority].list_){
+                resolve(node);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Put a marker at the end of each ready list, the promises before
+       the markers are the snapshot to run. The other run paths skip the
+       markers, but snapshots do not nest */
+    static void snapshot(){
+        ready_lists *lists = get_lists();
+        for(size_t priority = 0; priority < PM_PRIORITY_LEVELS; ++priority){
+            pm_assert(lists->markers_[priority].list_.empty());
+            lists->lists_[priority].list_.attach(&lists->markers_[priority].list_);
+        }
+        lists->running_ = 0;
+    }
+
+    /* Resolve one promise from the highest priority of the snapshot,
+       return false if the snapshot is drained. The markers stay until
+       drop_snapshot(), a promise woken meanwhile may still join the snapshot */
+    static bool run_snapshot_one(){
+        ready_lists *lists = get_lists();
+        for(size_t priority = PM_PRIORITY_LEVELS; priority-- > 0; ){
+            pm_list *marker = &lists->markers_[priority].list_;
+            if(marker->empty()) continue;
+
+            pm_list *node = lists->lists_[priority].list_.next();
+            if(node == marker) continue;
+            lists->running_ = (uint8_t)priority;
+            resolve(node);
+            return true;
+        }
+        return false;
+    }
+
+    /* Remove the markers of the snapshot,
+       return the number of promises still before them */
+    static uint32_t drop_snapshot(){
+        ready_lists *lists = get_lists();
+        uint32_t count = 0;
+        for(size_t priority = 0; priority < PM_PRIORITY_LEVELS; ++priority){
+            pm_list *marker = &lists->markers_[priority].list_;
+            if(marker->empty()) continue;
+
+            pm_list *list = &lists->lists_[priority].list_;
+            for(pm_list *node = list->next(); node != marker; node = node->next())
+                ++count;
+            marker->detach();
+        }
+        return count;
+    }
+
+    /* Number of ready promises, it walks the lists */
+    static uint32_t size(){
+        ready_lists *lists = get_lists();
+        uint32_t count = 0;
+        for(size_t priority = 0; priority < PM_PRIORITY_LEVELS; ++priority){
+            pm_list *list = &lists->lists_[priority].list_;
+            pm_list *marker = &lists->markers_[priority].list_;
+            for(pm_list *node = list->next(); node != list; node = node->next()){
+                if(node != marker)
+                    ++count;
+            }
+        }
+        return count;
+    }
+
+    /* Create the ready lists, for pm_freeze() */
+    static void init(){
+        get_lists();
+        get_stats();
     }
 
-    static inline void remove(const Defer &defer){
-        remove(get_list(), defer);
+    static pm_run_stats *get_stats(){
+        static pm_run_stats *stats = nullptr;
+        if(stats == nullptr)
+            stats = pm_stack_new<pm_run_stats>();
+        return stats;
     }
+
+    static bool empty(){
+        ready_lists *lists = get_lists();
+        for(size_t priority = 0; priority < PM_PRIORITY_LEVELS; ++priority){
+            if(first(lists, priority) != &lists->lists_[priority].list_)
+                return false;
+        }
+        return true;
+    }
+
+    static inline pm_list *get_list(uint8_t priority = 0){
+        return &get_lists()->lists_[priority].list_;
+    }
+
 private:
-    static pm_list *get_list(){
-        static pm_list *list = nullptr;
-        if(list == nullptr)
-            list = pm_stack_new<pm_list>();
-        return list;
+    static void resolve(pm_list *node){
+        node->detach();
+        /* Take over the reference held by the list */
+        Defer defer_(from_list(node));
+
+        uint8_t &current = Promise::current_priority();
+        uint8_t parent = current;
+        current = defer_->priority_;
+        defer_.resolve();
+        current = parent;
+    }
+
+    struct ready_list{
+        alignas(void *) pm_list list_;
+    };
+    struct ready_lists{
+        ready_list lists_[PM_PRIORITY_LEVELS];
+        ready_list markers_[PM_PRIORITY_LEVELS];
+        uint8_t running_;       /* Priority of the snapshot promise run last */
+    };
+    static ready_lists *get_lists(){
+        static ready_lists *lists = nullptr;
+        if(lists == nullptr)
+            lists = pm_stack_new<ready_lists>();
+        return lists;
+    }
+
+    /* The first promise of a ready list, past the marker of a snapshot,
+       or the list itself if there is none */
+    static pm_list *first(ready_lists *lists, size_t priority){
+        pm_list *node = lists->lists_[priority].list_.next();
+        if(node == &lists->markers_[priority].list_)
+            node = node->next();
+        return node;
     }
 };
 
@@ -4,17 +4,245 @@
 
 //#include "promise.hpp"
 
+/* Disable and enable interrupts, PRIMASK of Cortex-M by default,
+   see posix.hpp for Linux */
+#ifndef PM_IRQ_DISABLE
+#define PM_IRQ_DISABLE()    __set_PRIMASK(1)
+#endif
+#ifndef PM_IRQ_ENABLE
+#define PM_IRQ_ENABLE()     __set_PRIMASK(0)
+#endif
+
+#ifdef PM_IRQ_COUNTING
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_8M_MAIN__) \
+    || defined(__TARGET_ARCH_7_M) || defined(__TARGET_ARCH_7E_M)
+#define PM_ATOMIC_LDREX
+#elif defined(__ARM_ARCH_6M__) || defined(__TARGET_ARCH_6S_M)
+#define PM_ATOMIC_PRIMASK
+#else
+#include <atomic>
+#endif
+#endif
+
 namespace promise{
 
 static inline void irq_disable(){
-    __set_PRIMASK(1);
+    PM_IRQ_DISABLE();
 }
 
 static inline void irq_enable(){
-    __set_PRIMASK(0);
+    PM_IRQ_ENABLE();
 }
 
+#ifdef PM_IRQ_COUNTING
+/* Counter shared by interrupt and thread without masking interrupts,
+   Cortex-M3/M4/M7 use LDREX/STREX, Cortex-M0 has no exclusive access and
+   masks interrupts for a few instructions, other targets use std::atomic.
+   A static counter is constant initialized, and safe to use in interrupt
+   before anything else runs. */
+#if defined(PM_ATOMIC_LDREX)
+struct pm_atomic_count{
+    volatile uint32_t value_;
+    constexpr pm_atomic_count()
+        : value_(0){
+    }
+
+    uint32_t load(){
+        return value_;
+    }
+
+    void add(uint32_t n){
+        uint32_t value;
+        do{
+            value = __LDREXW(&value_) + n;
+        }while(__STREXW(value, &value_) != 0);
+    }
+
+    /* Decrease by one if not zero */
+    bool take(){
+        uint32_t value;
+        do{
+            value = __LDREXW(&value_);
+            if(value == 0){
+                __CLREX();
+                return false;
+            }
+        }while(__STREXW(value - 1, &value_) != 0);
+        return true;
+    }
+
+    uint32_t exchange(uint32_t n){
+        uint32_t value;
+        do{
+            value = __LDREXW(&value_);
+        }while(__STREXW(n, &value_) != 0);
+        return value;
+    }
+};
+#elif defined(PM_ATOMIC_PRIMASK)
+struct pm_atomic_count{
+    volatile uint32_t value_;
+    constexpr pm_atomic_count()
+        : value_(0){
+    }
+
+    uint32_t load(){
+        return value_;
+    }
+
+    void add(uint32_t n){
+        uint32_t primask = __get_PRIMASK();
+        __set_PRIMASK(1);
+        value_ += n;
+        __set_PRIMASK(primask);
+    }
+
+    /* Decrease by one if not zero */
+    bool take(){
+        uint32_t primask = __get_PRIMASK();
+        __set_PRIMASK(1);
+        bool taken = (value_ != 0);
+        if(taken) --value_;
+        __set_PRIMASK(primask);
+        return taken;
+    }
+
+    uint32_t exchange(uint32_t n){
+        uint32_t primask = __get_PRIMASK();
+        __set_PRIMASK(1);
+        uint32_t value = value_;
+        value_ = n;
+        __set_PRIMASK(primask);
+        return value;
+    }
+};
+#else
+struct pm_atomic_count{
+    std::atomic<uint32_t> value_;
+    constexpr pm_atomic_count()
+        : value_(0){
+    }
+
+    uint32_t load(){
+        return value_.load();
+    }
+
+    void add(uint32_t n){
+        value_.fetch_add(n);
+    }
+
+    /* Decrease by one if not zero */
+    bool take(){
+        uint32_t value = value_.load();
+        do{
+            if(value == 0) return false;
+        }while(!value_.compare_exchange_weak(value, value - 1));
+        return true;
+    }
+
+    uint32_t exchange(uint32_t n){
+        return value_.exchange(n);
+    }
+};
+#endif
+
+/* Counting events, post() in interrupt only increases counters, and is
+   never lost when nobody is waiting. Each post() resolves one waiting
+   promise, in the order they wait, or the next one to wait.
+   The counters are static, so post() never creates anything in interrupt.
+   The events and the waiting lists are created and touched only in thread. */
 struct irq_x{
+    struct event{
+        alignas(void *) pm_list list_;      /* Link in the event list */
+        alignas(void *) pm_list waiting_;
+        pm_atomic_count *count_;            /* Static counter of the irq */
+        event(pm_atomic_count *count)
+            : list_()
+            , waiting_()
+            , count_(count){
+        }
+    };
+    typedef event waiting_t;
+
+    static waiting_t *new_waiting(pm_atomic_count *count){
+        event *e = pm_stack_new<event>(count);
+        get_events()->attach(&e->list_);
+        return e;
+    }
+
+    /* Called in thread, with or without interrupts disabled */
+    static void wait__(event *e, const Defer &defer){
+        if(e->count_->take())
+            defer_list::attach(defer);
+        else
+            defer_list::attach(&e->waiting_, defer);
+    }
+
+    /* Called in interrupt, counts before the event of the irq exists,
+       its first wait() takes the count */
+    static void post__(pm_atomic_count *count){
+        count->add(1);
+        get_posted().add(1);
+    }
+
+    /* Called in thread */
+    static void kill__(event *e, Defer &defer){
+        (void)e;
+        if(defer.operator->()){
+            Defer no_ref = defer;
+            defer.clear();
+
+            if(no_ref->status_ == Promise::kInit){
+                defer_list::remove(no_ref);
+                no_ref.reject();
+            }
+        }
+    }
+
+    /* Any irq posted but not run yet */
+    static bool pending(){
+        return get_posted().load() != 0;
+    }
+
+    /* Create the event list, for pm_freeze() */
+    static void init(){
+        get_events();
+    }
+
+    static void run(){
+        if(get_posted().exchange(0) != 0){
+            pm_list *events = get_events();
+            for(pm_list *node = events->next(); node != events; node = node->next()){
+                event *e = pm_container_of(node, &event::list_);
+                while(!e->waiting_.empty() && e->count_->take())
+                    defer_list::ready(e->waiting_.next());
+            }
+        }
+    }
+
+private:
+    /* Posts of all irqs since the last run() */
+    static inline pm_atomic_count &get_posted(){
+        static pm_atomic_count posted;
+        return posted;
+    }
+
+    static inline pm_list *get_events(){
+        static pm_list *list = nullptr;
+        if(list == nullptr)
+            list = pm_stack_new<pm_list>();
+        return list;
+    }
+};
+
+#else
+struct irq_x{
+    typedef pm_list waiting_t;
+
+    static waiting_t *new_waiting(){
+        return pm_stack_new<pm_list>();
+    }
+
     /* Called in thread, need call -- 
         irq_disable();
         //add user code ...
@@ -38,24 +266,34 @@ struct irq_x{
     }
     
     /* Called in thread */
-    static void kill__(pm_list *irq_list, Defer &defer){
+    static void kill__(pm_list *, Defer &defer){
         if(defer.operator->()){
             Defer no_ref = defer;
             defer.clear();
 
             if(no_ref->status_ == Promise::kInit){
-                defer_list::remove(irq_list, no_ref);
-                ready_list *ready = get_ready_list();
+                /* Linked in irq_list, the irq ready list or the ready list,
+                   post__() may splice it in interrupt */
                 irq_disable();
-                defer_list::remove(&ready->list_, no_ref);
+                defer_list::remove(no_ref);
                 irq_enable();
 
-                defer_list::remove(no_ref);
                 no_ref.reject();
             }
         }
     }
 
+    /* Any irq posted but not run yet */
+    static bool pending(){
+        ready_list *ready = get_ready_list();
+        return ready->ready_;
+    }
+
+    /* Create the irq ready list, for pm_freeze() */
+    static void init(){
+        get_ready_list();
+    }
+
     static void run(){
         ready_list *ready = get_ready_list();
         if(ready->ready_){
@@ -83,6 +321,7 @@ private:
     }
 
 };
+#endif
 
 template<int IRQ>
 struct irq{
@@ -91,17 +330,39 @@ struct irq{
     }
 
     static void post(){
+#ifdef PM_IRQ_COUNTING
+        /* Only the static counter, the event is created by wait() in thread */
+        irq_x::post__(&get_count());
+#else
         irq_x::post__(get_waiting_list());
+#endif
     }
 
     static void kill(Defer &defer){
         irq_x::kill__(get_waiting_list(), defer);
     }
+
+    /* Create the waiting list at init, else the first wait() or post() does.
+       With PM_IRQ_COUNTING the first wait() does, post() never */
+    static void init(){
+        get_waiting_list();
+    }
 private:
-    static pm_list *get_waiting_list(){
-        static pm_list *list = nullptr;
+#ifdef PM_IRQ_COUNTING
+    static pm_atomic_count &get_count(){
+        static pm_atomic_count count;
+        return count;
+    }
+#endif
+
+    static irq_x::waiting_t *get_waiting_list(){
+        static irq_x::waiting_t *list = nullptr;
         if(list == nullptr)
-            list = pm_stack_new<pm_list>();
+#ifdef PM_IRQ_COUNTING
+            list = irq_x::new_waiting(&get_count());
+#else
+            list = irq_x::new_waiting();
+#endif
         return list;
     }
 };
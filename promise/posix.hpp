@@ -0,0 +1,227 @@
+#pragma once
+#ifndef INC_POSIX_HPP_
+#define INC_POSIX_HPP_
+
+/* Port to Linux and other POSIX systems, include it instead of promise.hpp,
+ * or define PM_POSIX_FULL to use promise_full.hpp.
+ *
+ * - irq_disable()/irq_enable() lock a mutex, and like PRIMASK they do not nest
+ * - pm_timer::init_system() starts a thread calling pm_timer::increase_ticks()
+ *   from the monotonic clock, as SysTick_Handler does
+ * - pm_posix::interrupt(handler) runs handler as an interrupt from any thread --
+ *       pm_posix::interrupt([](){ irq<1>::post(); });
+ * - pm_posix::idle() waits for the next interrupt instead of __WFE()
+ *
+ *     void pm_run_loop(){
+ *         pm_timer::init_system(0);
+ *         while(true){
+ *             pm_run();
+ *             pm_posix::idle();
+ *         }
+ *     }
+ *
+ * With tickless idle, the tick thread stops until the next timer expires --
+ *         pm_run();
+ *         pm_idle<pm_posix>(pm_posix::wait);
+ */
+
+#include <stdint.h>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace promise{
+
+struct pm_posix {
+    typedef std::chrono::steady_clock clock;    /* CLOCK_MONOTONIC */
+
+    static void init(){
+        state *st = get_state();
+        if(!st->started_){
+            st->started_ = true;
+            st->start_ = clock::now();
+            std::thread(pm_posix::tick_thread).detach();
+        }
+    }
+
+    /* Interrupts are disabled for all threads but the calling one */
+    static void irq_disable(){
+        bool &masked = get_masked();
+        if(!masked){
+            get_state()->mutex_.lock();
+            masked = true;
+        }
+    }
+
+    static void irq_enable(){
+        bool &masked = get_masked();
+        if(masked){
+            masked = false;
+            get_state()->mutex_.unlock();
+        }
+    }
+
+    /* Run handler as an interrupt, and wake up idle() */
+    template <typename FUNC>
+    static void interrupt(FUNC handler){
+        irq_disable();
+        handler();
+        irq_disable();  /* The handler may have called irq_enable() */
+        pm_posix::signal();
+        irq_enable();
+    }
+
+    /* Wait for an interrupt since the last idle() or wait(), as __WFE() does */
+    static void idle(){
+        bool masked = get_masked();
+        irq_disable();
+        wait_until(clock::time_point::max());
+        if(!masked)
+            irq_enable();
+    }
+
+    /* Clock of pm_idle(), the tick thread stops between suspend() and resume() */
+    static uint32_t suspend(uint32_t ticks){
+        state *st = get_state();
+        st->suspended_ = true;
+        st->deadline_ = st->ticks_ + ticks;
+        return ticks;
+    }
+
+    static uint32_t resume(){
+        state *st = get_state();
+        uint64_t now = now_ticks();
+        uint32_t ticks = (now > st->ticks_ ? (uint32_t)(now - st->ticks_) : 0);
+        st->ticks_ += ticks;
+        st->suspended_ = false;
+        st->cond_.notify_all();
+        return ticks;
+    }
+
+    /* Called by pm_idle() with interrupts disabled, returns on an interrupt
+       or at the timeout given to suspend() */
+    static void wait(){
+        state *st = get_state();
+        wait_until(st->start_ + ticks_to_duration(st->deadline_));
+    }
+
+    static inline uint64_t now_ticks();
+
+    /* Times idle() or wait() returned */
+    static uint32_t wakeups(){
+        return get_state()->wakeups_;
+    }
+
+private:
+    struct state {
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        clock::time_point start_;
+        uint64_t ticks_;            /* Ticks given to pm_timer */
+        uint64_t deadline_;         /* wait() returns at this tick */
+        bool started_;
+        bool suspended_;            /* Tick thread stopped by pm_idle() */
+        bool event_;                /* Interrupt since the last idle() or wait() */
+        uint32_t wakeups_;
+        state()
+            : ticks_(0)
+            , deadline_(0)
+            , started_(false)
+            , suspended_(false)
+            , event_(false)
+            , wakeups_(0){
+        }
+    };
+
+    static state *get_state(){
+        /* Never freed, the tick thread runs until exit */
+        static state *st = new state();
+        return st;
+    }
+
+    static bool &get_masked(){
+        static thread_local bool masked = false;
+        return masked;
+    }
+
+    static inline clock::duration ticks_to_duration(uint64_t ticks);
+
+    /* Called with interrupts disabled */
+    static void signal(){
+        state *st = get_state();
+        st->event_ = true;
+        st->cond_.notify_all();
+    }
+
+    /* Called with interrupts disabled, they are enabled while waiting */
+    static void wait_until(clock::time_point deadline){
+        state *st = get_state();
+        std::unique_lock<std::mutex> lock(st->mutex_, std::adopt_lock);
+        while(!st->event_ && clock::now() < deadline){
+            if(deadline == clock::time_point::max())
+                st->cond_.wait(lock);
+            else
+                st->cond_.wait_until(lock, deadline);
+        }
+        st->event_ = false;
+        ++st->wakeups_;
+        lock.release();
+    }
+
+    static inline void tick_thread();
+};
+
+}
+
+#define PM_IRQ_DISABLE()        promise::pm_posix::irq_disable()
+#define PM_IRQ_ENABLE()         promise::pm_posix::irq_enable()
+#define PM_TICK_INIT(reload)    ((void)(reload), promise::pm_posix::init())
+
+#ifndef PM_EMBED_STACK
+#define PM_EMBED_STACK          65536   /* Pointers are 64 bits on most hosts */
+#endif
+
+#ifdef PM_POSIX_FULL
+#include "promise_full.hpp"
+#else
+#include "promise.hpp"
+#endif
+
+namespace promise{
+
+inline uint64_t pm_posix::now_ticks(){
+    state *st = get_state();
+    uint64_t nsec = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        clock::now() - st->start_).count();
+    return nsec * TT_TICKS_PER_SECOND / 1000000000;
+}
+
+inline pm_posix::clock::duration pm_posix::ticks_to_duration(uint64_t ticks){
+    return std::chrono::duration_cast<clock::duration>(
+        std::chrono::nanoseconds(ticks * 1000000000 / TT_TICKS_PER_SECOND));
+}
+
+inline void pm_posix::tick_thread(){
+    state *st = get_state();
+    std::unique_lock<std::mutex> lock(st->mutex_);
+    while(true){
+        while(st->suspended_)
+            st->cond_.wait(lock);
+
+        clock::time_point next = st->start_ + ticks_to_duration(st->ticks_ + 1);
+        lock.unlock();
+        std::this_thread::sleep_until(next);
+        lock.lock();
+
+        if(!st->suspended_){
+            for(uint64_t now = now_ticks(); st->ticks_ < now; ++st->ticks_)
+                pm_timer::increase_ticks();
+            pm_posix::signal();
+        }
+    }
+}
+
+}
+
+#endif
@@ -31,18 +31,64 @@
 
 //#define PM_DEBUG
 #define PM_EMBED
+#ifndef PM_EMBED_STACK
 #define PM_EMBED_STACK 2048
+#endif
+
+/* Number of priority classes of the ready list, 0 is the lowest */
+#ifndef PM_PRIORITY_LEVELS
+#define PM_PRIORITY_LEVELS 1
+#endif
+
+/* Size classes of the memory pools, objects of near sizes share one pool.
+   PM_SIZE_CLASS_STEPS is the number of classes between two powers of two --
+   0: one class for each pointer-rounded size, 1: powers of two,
+   4: classes at most 1.25x apart. Sizes above PM_SIZE_CLASS_MAX keep their own class. */
+#ifndef PM_SIZE_CLASS_STEPS
+#define PM_SIZE_CLASS_STEPS 0
+#endif
+#ifndef PM_SIZE_CLASS_MAX
+#define PM_SIZE_CLASS_MAX 256
+#endif
+
+/* Carve the pool blocks from pages of PM_SLAB_PAGE bytes, a power of 2.
+   Pages without live blocks go to the pools that need one, of any size class. */
+//#define PM_SLAB_PAGE 256
+
+/* The callers of then() are put in the block of the new promise, one
+   allocation for each then(), if they take at most PM_INLINE_CALLER bytes.
+   Larger ones are obtained apart. 0 obtains them apart always. */
+#ifndef PM_INLINE_CALLER
+#define PM_INLINE_CALLER (4 * sizeof(void *))
+#endif
+
+/* The values of resolve() and reject() are kept in the promise, without
+   allocation, if they take at most PM_INLINE_ANY bytes. Larger ones are
+   obtained apart. 0 obtains them apart always. Every Promise is about
+   PM_INLINE_ANY bytes larger for it, even one that never has a value. */
+#ifndef PM_INLINE_ANY
+#define PM_INLINE_ANY (2 * sizeof(void *))
+#endif
+
+/* Promise and the callers of then() have no vtable, the callers are called
+   and destroyed through a pair of function pointers in the promise. */
+//#define PM_NO_VTABLE
+
+/* Pointers to objects in the arena -- Defer, the callers of then() and pm_any --
+   are kept as pm_stack::itr_t offsets, which are 16 bits if the arena has at
+   most 65536 pointer sized words. */
+//#define PM_COMPACT_PTR
 
 #include <memory>
 #include <typeinfo>
 #include <utility>
 #include <algorithm>
+#include <cstring>
 
 #if defined __ARMCC_VERSION && __ARMCC_VERSION < 6000000
 /* Missing headers for ARMCC */
 #else
 #include <tuple>
-#include <typeindex>
 #include <type_traits>
 #endif
 
@@ -196,17 +242,8 @@ struct make_index_sequence
 template<> struct make_index_sequence<0> : index_sequence<> { };
 template<> struct make_index_sequence<1> : index_sequence<0> { };
 
-typedef const std::type_info *type_index;
-inline type_index get_type_index(const std::type_info &info){
-    return type_index(&info);
-}
-
 }
 
-#else
-inline std::type_index get_type_index(const std::type_info &info){
-    return std::type_index(info);
-}
 #endif
 
 
@@ -232,10 +269,45 @@ inline void pm_throw(const T &t){
 }
 
 
+/* Types are identified by the address of a static member of pm_type<T>,
+   without RTTI. As typeid, references and top level cv are ignored. The
+   member is not const, so that it is not merged with the one of another type. */
+typedef const void *pm_type_id;
+
+template<typename T>
+struct pm_type {
+    static char id_;
+};
+
+template<typename T>
+char pm_type<T>::id_;
+
+template<typename T>
+inline constexpr pm_type_id pm_type_of() {
+    return &pm_type<typename std::remove_cv<typename std::remove_reference<T>::type>::type>::id_;
+}
+
 inline constexpr size_t pm_log(size_t n) {
     return (n <= 1 ? 0 : 1 + pm_log(n >> 1));
 }
 
+inline constexpr size_t pm_round_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+/* Distance between the classes from the power of two below size */
+inline constexpr size_t pm_size_class_step(size_t size, size_t steps) {
+    return ((size_t)1 << pm_log(size)) / steps < sizeof(void *)
+        ? sizeof(void *) : ((size_t)1 << pm_log(size)) / steps;
+}
+
+/* Pool size of an object of size bytes */
+inline constexpr size_t pm_size_class(size_t size) {
+    return (PM_SIZE_CLASS_STEPS == 0 || size > PM_SIZE_CLASS_MAX)
+        ? pm_round_up(size, sizeof(void *))
+        : pm_round_up(size, pm_size_class_step(size, PM_SIZE_CLASS_STEPS));
+}
+
 template<bool match_uint8, bool match_uint16, bool match_uint32>
 struct pm_offset_impl {
     typedef uint64_t type;
@@ -272,21 +344,63 @@ struct pm_stack {
     }
 
     static void *allocate(size_t size) {
-        static char *top = start();
+        char *&top = get_top();
         char *start_ = start();
 
         size = (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
-        if (start_ + PM_EMBED_STACK < top + size)
+        if (get_bottom() < top + size)
             pm_throw("no_mem");
+        if (frozen())
+            pm_throw("frozen");
 
         void *ret = top;
         top += size;
 
-        g_stack_size = (uint32_t)(top - start_);
+        g_stack_size = (uint32_t)(top - start_ + (start_ + PM_EMBED_STACK - get_bottom()));
         //printf("mem ======= %d %d, size = %d, %d, %d, %x\n", (int)(top - start_), (int)sizeof(void *), (int)size, OFFSET_IGNORE_BIT, (int)sizeof(itr_t), ret);
         return ret;
     }
 
+#ifdef PM_SLAB_PAGE
+    /* Pages are taken from the end of the arena, aligned to PM_SLAB_PAGE from
+       start(), so the page of a block is found from its address */
+    static void *allocate_page() {
+        static_assert((PM_SLAB_PAGE & (PM_SLAB_PAGE - 1)) == 0, "PM_SLAB_PAGE must be a power of 2");
+        char *&bottom = get_bottom();
+        char *start_ = start();
+
+        size_t offset = (size_t)(bottom - start_);
+        if (offset < PM_SLAB_PAGE)
+            pm_throw("no_mem");
+        char *page = start_ + ((offset - PM_SLAB_PAGE) & ~((size_t)PM_SLAB_PAGE - 1));
+        if (page < get_top())
+            pm_throw("no_mem");
+        if (frozen())
+            pm_throw("frozen");
+        bottom = page;
+
+        g_stack_size = (uint32_t)(get_top() - start_ + (start_ + PM_EMBED_STACK - bottom));
+        return page;
+    }
+#endif
+
+    /* The arena is used from start() up to get_top(), and from get_bottom() to the end */
+    static char *&get_top() {
+        static char *top = start();
+        return top;
+    }
+
+    static char *&get_bottom() {
+        static char *bottom = start() + PM_EMBED_STACK;
+        return bottom;
+    }
+
+    /* Set by pm_freeze(), no more memory is taken from the arena */
+    static bool &frozen() {
+        static bool frozen_ = false;
+        return frozen_;
+    }
+
     static const size_t OFFSET_IGNORE_BIT = pm_log(sizeof(void *));
     typedef pm_offset<PM_EMBED_STACK, sizeof(void *)>::type itr_t;
     //static const size_t OFFSET_IGNORE_BIT = 0;
@@ -314,13 +428,68 @@ struct pm_stack {
 #endif
 };
 
+/* Pointer to an object in the arena, STORAGE is T * or pm_stack::itr_t */
+template <typename T, typename STORAGE>
+class pm_ptr {
+public:
+    pm_ptr(T *ptr = nullptr)
+        : itr_(pm_stack::ptr_to_itr(static_cast<void *>(ptr))) {
+    }
+
+    inline T *get() const {
+        return static_cast<T *>(pm_stack::itr_to_ptr(itr_));
+    }
+
+    inline T *operator->() const {
+        return get();
+    }
+
+    inline operator T *() const {
+        return get();
+    }
+
+private:
+    STORAGE itr_;
+};
+
+template <typename T>
+class pm_ptr<T, T *> {
+public:
+    pm_ptr(T *ptr = nullptr)
+        : ptr_(ptr) {
+    }
+
+    inline T *get() const {
+        return ptr_;
+    }
+
+    inline T *operator->() const {
+        return ptr_;
+    }
+
+    inline operator T *() const {
+        return ptr_;
+    }
+
+private:
+    T *ptr_;
+};
+
+#ifdef PM_COMPACT_PTR
+template <typename T>
+using pm_arena_ptr = pm_ptr<T, pm_stack::itr_t>;
+#else
+template <typename T>
+using pm_arena_ptr = pm_ptr<T, T *>;
+#endif
+
 template< class T, class... Args >
 inline T *pm_stack_new(Args&&... args) {
     return new
 #ifdef PM_EMBED_STACK
         (pm_stack::allocate(sizeof(T)))
 #endif
-        T(args...);
+        T(std::forward<Args>(args)...);
 }
 
 
@@ -409,13 +578,131 @@ private:
 };
 
 
+#ifdef PM_SLAB_PAGE
+/* Statistics of the pages */
+struct pm_slab_stats{
+    uint32_t pages_;        /* Pages taken from the arena */
+    uint32_t free_;         /* Pages in pm_slab_page::get_free_pages() */
+    uint32_t empty_;        /* Pages of pools without live blocks, they can be reclaimed */
+    uint32_t reclaims_;     /* Pages reused from pm_slab_page::get_free_pages() */
+    pm_slab_stats()
+        : pages_(0)
+        , free_(0)
+        , empty_(0)
+        , reclaims_(0){
+    }
+};
+
+/* A page of pool blocks, linked in the pages_ of its pool,
+   or in get_free_pages() after it's reclaimed */
+struct pm_slab_page {
+    alignas(void *) pm_list list_;
+    pm_stack::itr_t live_;          /* Blocks in use */
+    pm_slab_page()
+        : list_()
+        , live_(0){
+    }
+
+    static inline pm_slab_page *from_list(pm_list *node){
+        return pm_container_of(node, &pm_slab_page::list_);
+    }
+
+    /* The page of a block */
+    static inline pm_slab_page *from_ptr(void *ptr){
+        size_t offset = (size_t)(reinterpret_cast<char *>(ptr) - pm_stack::start());
+        return reinterpret_cast<pm_slab_page *>(pm_stack::start() + (offset & ~((size_t)PM_SLAB_PAGE - 1)));
+    }
+
+    /* Offset of the first block */
+    static inline size_t data_offset(){
+        return pm_round_up(sizeof(pm_slab_page), sizeof(void *));
+    }
+
+    /* Blocks of buf_size bytes in a page, 0 if a block is larger than a page */
+    static inline size_t capacity(size_t buf_size){
+        return (PM_SLAB_PAGE - data_offset()) / buf_size;
+    }
+
+    inline void *block(size_t index, size_t buf_size){
+        return reinterpret_cast<char *>(this) + data_offset() + index * buf_size;
+    }
+
+    static pm_list *get_free_pages(){
+        static pm_list *pages = nullptr;
+        if(pages == nullptr)
+            pages = pm_stack_new<pm_list>();
+        return pages;
+    }
+
+    static pm_slab_stats *get_stats(){
+        static pm_slab_stats *stats = nullptr;
+        if(stats == nullptr)
+            stats = pm_stack_new<pm_slab_stats>();
+        return stats;
+    }
+};
+#endif
+
+/* One pool for each size class, all pools are linked in get_pools() for statistics.
+   A pool can not have more blocks than the arena, so pm_stack::itr_t holds the counts. */
 struct pm_memory_pool {
     pm_list free_;
+    alignas(void *) pm_list list_;  /* Link in get_pools() */
+#ifdef PM_SLAB_PAGE
+    alignas(void *) pm_list pages_; /* Pages of the blocks */
+    pm_stack::itr_t page_blocks_;   /* Blocks in each page, 0 if blocks are larger than pages */
+    pm_stack::itr_t reserved_;      /* Blocks kept by pm_allocator::reserve(), not reclaimed */
+#endif
     size_t size_;
-    pm_memory_pool(size_t size)
+    size_t buf_size_;               /* Arena bytes of each block, header included */
+    pm_stack::itr_t blocks_;        /* Blocks taken from the arena */
+    pm_stack::itr_t live_;          /* Blocks in use */
+    pm_stack::itr_t peak_;          /* Maximum of live_ */
+    pm_memory_pool(size_t size, size_t buf_size)
         : free_()
-        , size_(size){
+        , list_()
+#ifdef PM_SLAB_PAGE
+        , pages_()
+        , page_blocks_((pm_stack::itr_t)pm_slab_page::capacity(buf_size))
+        , reserved_(0)
+#endif
+        , size_(size)
+        , buf_size_(buf_size)
+        , blocks_(0)
+        , live_(0)
+        , peak_(0){
+        get_pools()->attach(&list_);
+    }
+
+    static pm_list *get_pools(){
+        static pm_list *pools = nullptr;
+        if(pools == nullptr)
+            pools = pm_stack_new<pm_list>();
+        return pools;
+    }
+
+    static inline pm_memory_pool *from_list(pm_list *node){
+        return pm_container_of(node, &pm_memory_pool::list_);
+    }
+
+    size_t free_count() const {
+        return (size_t)blocks_ - live_;
+    }
+
+#ifdef PM_SLAB_PAGE
+    size_t page_count() const {
+        return (page_blocks_ == 0 ? 0 : (size_t)blocks_ / page_blocks_);
+    }
+
+    size_t arena_bytes() const {
+        return sizeof(pm_memory_pool) + (page_blocks_ == 0
+            ? (size_t)blocks_ * buf_size_ : page_count() * PM_SLAB_PAGE);
+    }
+#else
+    size_t arena_bytes() const {
+        return sizeof(pm_memory_pool) + (size_t)blocks_ * buf_size_;
     }
+#endif
 };
 
 //allocator
@@ -478,7 +765,7 @@ struct pm_size_allocator {
     static pm_memory_pool *get_memory_pool() {
         static pm_memory_pool *pool_ = nullptr;
         if(pool_ == nullptr)
-            pool_ = pm_stack_new<pm_memory_pool>(SIZE);
+            pool_ = pm_stack_new<pm_memory_pool>(SIZE, sizeof(pm_memory_pool_buf<SIZE>));
         return pool_;
     }
 };
@@ -495,8 +782,22 @@ private:
     template <size_t SIZE>
     static void *obtain_impl() {
         g_alloc_size += SIZE;
+        ++obtain_count();
         pm_memory_pool *pool = pm_size_allocator<SIZE>::get_memory_pool();
+        if (++pool->live_ > pool->peak_)
+            pool->peak_ = pool->live_;
+#ifdef PM_SLAB_PAGE
+        if (pool->page_blocks_ != 0) {
+            if (pool->free_.empty())
+                add_page(pool);
+            pm_memory_pool_buf_header *header = obtain_pool_buf(pool);
+            if (pm_slab_page::from_ptr(header)->live_++ == 0)
+                --pm_slab_page::get_stats()->empty_;
+            return pm_memory_pool_buf_header::to_ptr(header);
+        }
+#endif
         if (pool->free_.empty()) {
+            ++pool->blocks_;
             pm_memory_pool_buf<SIZE> *pool_buf = 
                 pm_stack_new<pm_memory_pool_buf<SIZE>>(pool);
             //printf("++++ obtain = %p %d\n", (void *)&pool_buf->buf_, sizeof(T));
@@ -511,11 +812,80 @@ private:
         }
     }
 
+#ifdef PM_SLAB_PAGE
+    /* Carve the blocks of a page to the free list of pool */
+    static void add_page(pm_memory_pool *pool) {
+        pm_slab_page *page = obtain_page();
+        ++pm_slab_page::get_stats()->empty_;
+
+        pool->pages_.attach(&page->list_);
+        for (size_t i = 0; i < pool->page_blocks_; ++i) {
+            pm_memory_pool_buf_header *header = new(page->block(i, pool->buf_size_))
+                pm_memory_pool_buf_header(pool);
+            pool->free_.attach(&header->list_);
+        }
+        pool->blocks_ += pool->page_blocks_;
+    }
+
+    /* A reclaimed page if there's one, or a new page from the arena */
+    static pm_slab_page *obtain_page() {
+        pm_slab_stats *stats = pm_slab_page::get_stats();
+        pm_list *free_pages = pm_slab_page::get_free_pages();
+        if (free_pages->empty() && stats->empty_ > 0)
+            reclaim();
+
+        if (!free_pages->empty()) {
+            pm_list *node = free_pages->next();
+            node->detach();
+            --stats->free_;
+            ++stats->reclaims_;
+            return pm_slab_page::from_list(node);
+        }
+
+        ++stats->pages_;
+        return new(pm_stack::allocate_page()) pm_slab_page();
+    }
+#endif
+
+    template <typename WRITE>
+    static void write_line(WRITE &write,
+        const char *name0, size_t value0, const char *name1, size_t value1,
+        const char *name2, size_t value2, const char *name3, size_t value3,
+        const char *name4 = nullptr, size_t value4 = 0) {
+        const char *names[] = { name0, name1, name2, name3, name4 };
+        size_t values[] = { value0, value1, value2, value3, value4 };
+        for(size_t i = 0; i < 5 && names[i] != nullptr; ++i){
+            char buf[24];
+            char *str = buf + sizeof(buf) - 1;
+            *str = '\0';
+            size_t value = values[i];
+            do{
+                *--str = (char)('0' + value % 10);
+                value /= 10;
+            }while(value != 0);
+            write(names[i]);
+            write(str);
+        }
+        write("\n");
+    }
+
     static void release(void *ptr) {
         //printf("--- release = %p\n", ptr);
         pm_memory_pool_buf_header *header = pm_memory_pool_buf_header::from_ptr(ptr);
         pm_memory_pool *pool = reinterpret_cast<pm_memory_pool *>(pm_stack::itr_to_ptr(header->pool_));
+#ifdef PM_SLAB_PAGE
+        if (pool->page_blocks_ != 0) {
+            /* The last released block is obtained first, so that the other pages get empty */
+            pool->free_.next()->move(&header->list_);
+            if (--pm_slab_page::from_ptr(header)->live_ == 0)
+                ++pm_slab_page::get_stats()->empty_;
+        }
+        else
+            pool->free_.move(&header->list_);
+#else
         pool->free_.move(&header->list_);
+#endif
+        --pool->live_;
         g_alloc_size -= pool->size_;
     }
 
@@ -525,6 +895,7 @@ private:
             pm_memory_pool_buf_header *header = pm_memory_pool_buf_header::from_ptr(object);
             //printf("++ %p %d -> %d\n", pool_buf, pool_buf->ref_count_, pool_buf->ref_count_ + 1);
             ++header->ref_count_;
+            ++ref_count_ops();
         }
     }
 
@@ -535,6 +906,7 @@ private:
             //printf("-- %p %d -> %d\n", pool_buf, pool_buf->ref_count_, pool_buf->ref_count_ - 1);
             pm_assert(header->ref_count_ > 0);
             --header->ref_count_;
+            ++ref_count_ops();
             if (header->ref_count_ == 0) {
                 pm_allocator::release(object);
                 return true;
@@ -543,10 +915,133 @@ private:
         return false;
     }
 
+    template <size_t SIZE>
+    static void reserve_impl(size_t count) {
+        pm_memory_pool *pool = pm_size_allocator<SIZE>::get_memory_pool();
+#ifdef PM_SLAB_PAGE
+        if (pool->reserved_ < pool->live_ + count)
+            pool->reserved_ = (pm_stack::itr_t)(pool->live_ + count);
+#endif
+        while (pool->free_count() < count) {
+#ifdef PM_SLAB_PAGE
+            if (pool->page_blocks_ != 0) {
+                add_page(pool);
+                continue;
+            }
+#endif
+            pm_memory_pool_buf<SIZE> *pool_buf =
+                pm_stack_new<pm_memory_pool_buf<SIZE>>(pool);
+            pool->free_.move(&pool_buf->header_.list_);
+            ++pool->blocks_;
+        }
+    }
+
 public:
+    /* Make sure the pool of T has count free blocks, so that obtaining
+       them later takes nothing from the arena. Call it at init. */
+    template <typename T>
+    static void reserve(size_t count) {
+        reserve_impl<pm_size_class(sizeof(T))>(count);
+    }
+
+    /* Same as reserve() for objects of SIZE bytes, e.g. the sizes
+       printed by dump(), when the type is a lambda's caller */
+    template <size_t SIZE>
+    static void reserve_size(size_t count) {
+        reserve_impl<pm_size_class(SIZE)>(count);
+    }
+
+    /* Blocks obtained since start, for benchmarks */
+    static uint32_t &obtain_count() {
+        static uint32_t count = 0;
+        return count;
+    }
+
+    /* Reference count increments and decrements since start, for benchmarks */
+    static uint32_t &ref_count_ops() {
+        static uint32_t count = 0;
+        return count;
+    }
+
+#ifdef PM_SLAB_PAGE
+    /* Move the pages without live blocks from their pools to
+       pm_slab_page::get_free_pages(), return the number of pages moved.
+       It's called when a pool needs a page, or call it after a busy phase. */
+    static uint32_t reclaim() {
+        pm_slab_stats *stats = pm_slab_page::get_stats();
+        pm_list *free_pages = pm_slab_page::get_free_pages();
+        pm_list *pools = pm_memory_pool::get_pools();
+        uint32_t count = 0;
+        for (pm_list *node = pools->next(); node != pools && stats->empty_ > 0; node = node->next()) {
+            pm_memory_pool *pool = pm_memory_pool::from_list(node);
+            for (pm_list *page_node = pool->pages_.next(); page_node != &pool->pages_; ) {
+                pm_slab_page *page = pm_slab_page::from_list(page_node);
+                page_node = page_node->next();
+                if (page->live_ != 0 || pool->blocks_ < pool->reserved_ + pool->page_blocks_) continue;
+
+                for (size_t i = 0; i < pool->page_blocks_; ++i) {
+                    pm_memory_pool_buf_header *header = reinterpret_cast<pm_memory_pool_buf_header *>(
+                        page->block(i, pool->buf_size_));
+                    header->list_.detach();
+                }
+                pool->blocks_ -= pool->page_blocks_;
+                page->list_.detach();
+                free_pages->attach(&page->list_);
+                --stats->empty_;
+                ++stats->free_;
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    /* Bytes of the pages kept by the pools and not used by live blocks */
+    static size_t unused_bytes() {
+        size_t bytes = 0;
+        for_each_pool([&bytes](const pm_memory_pool &pool){
+            if (pool.page_blocks_ != 0)
+                bytes += pool.page_count() * PM_SLAB_PAGE - (size_t)pool.live_ * pool.buf_size_;
+        });
+        return bytes;
+    }
+#endif
+
+    /* Call func(const pm_memory_pool &) for each pool */
+    template <typename FUNC>
+    static void for_each_pool(FUNC func) {
+        pm_list *pools = pm_memory_pool::get_pools();
+        for(pm_list *node = pools->next(); node != pools; node = node->next())
+            func(*pm_memory_pool::from_list(node));
+    }
+
+    /* Print the statistics of each pool and the arena by write(const char *),
+       one line each, without stdio */
+    template <typename WRITE>
+    static void dump(WRITE write) {
+        for_each_pool([&write](const pm_memory_pool &pool){
+            write_line(write, "pool size ", pool.size_, " live ", pool.live_,
+                " free ", pool.free_count(), " peak ", pool.peak_,
+                " arena ", pool.arena_bytes());
+        });
+#ifdef PM_SLAB_PAGE
+        pm_slab_stats *stats = pm_slab_page::get_stats();
+        write_line(write, "pages ", stats->pages_, " free ", stats->free_,
+            " empty ", stats->empty_, " reclaims ", stats->reclaims_,
+            " unused ", unused_bytes());
+#endif
+        write_line(write, "arena used ", g_stack_size, " of ", PM_EMBED_STACK,
+            " alloc ", g_alloc_size, " obtains ", obtain_count());
+    }
+
     template <typename T>
     static inline void *obtain() {
-        return obtain_impl<sizeof(T)>();
+        return obtain_impl<pm_size_class(sizeof(T))>();
+    }
+
+    /* References held to an object obtained by pm_new() */
+    template<typename T>
+    static inline int16_t ref_count(T *object) {
+        return pm_memory_pool_buf_header::from_ptr(reinterpret_cast<void *>(const_cast<T *>(object)))->ref_count_;
     }
 
     template<typename T>
@@ -565,7 +1060,7 @@ public:
 
 template< class T, class... Args >
 inline T *pm_new(Args&&... args) {
-    T *object = new(pm_allocator::template obtain<T>()) T{args...};
+    T *object = new(pm_allocator::template obtain<T>()) T{std::forward<Args>(args)...};
     pm_allocator::add_ref(object);
     return object;
 }
@@ -600,133 +1095,93 @@ struct remove_rcv<const T &> {
     typedef typename remove_rcv<T &>::type type;
 };
 
-template<typename T>
-struct void_ptr_type {
-    static void *cast(const T &t) {
-        return reinterpret_cast<void *>(const_cast<char *>(&reinterpret_cast<const char &>(t)));
-    }
-};
+/* The elements of a tuple, found from the address of the tuple through a
+   table of one function for each element, which is in flash */
+template<typename TUPLE>
+struct offset_tuple_impl {
+    static const std::size_t size_ = std::tuple_size<TUPLE>::value;
+    typedef void *(*element_t)(const TUPLE *tuple);
 
-template<typename T>
-struct void_ptr_type<const T *> {
-    typedef const T* PT;
-    static void *cast(const PT &t) {
-        return (void *)(&t);
+    template<std::size_t N>
+    static void *element(const TUPLE *tuple) {
+        return const_cast<void *>(static_cast<const void *>(&std::get<N>(*tuple)));
     }
-};
-
-template<typename T>
-void *void_ptr_cast(const T &t) {
-    return void_ptr_type<T>::cast(t);
-}
 
-template<typename TUPLE, std::size_t SIZE>
-struct offset_tuple_impl {
-    template<size_t I_SIZE, std::size_t... I>
-    struct offset_array {
-        void *offsets_[I_SIZE];
+    static void *no_element(const TUPLE *) {
+        return nullptr;
+    }
 
-        offset_array(const TUPLE *tuple)
-            : offsets_{ void_ptr_cast(std::get<I>(*tuple))... } {
-        }
+    template<std::size_t... I>
+    struct element_array {
+        static constexpr element_t elements_[size_ + 1] = { &element<I>..., &no_element };
     };
 
     template<std::size_t... I>
-    static offset_array<SIZE, I...> get_array(const TUPLE *tuple, const std::index_sequence<I...> &) {
-        return offset_array<SIZE, I...>(tuple);
+    static element_array<I...> get_array(const std::index_sequence<I...> &) {
+        return element_array<I...>();
     }
 
-    decltype(get_array(nullptr, std::make_index_sequence<SIZE>())) value_;
-
-    offset_tuple_impl(const TUPLE *tuple)
-        : value_(get_array(tuple, std::make_index_sequence<SIZE>())) {
-    }
+    typedef decltype(get_array(std::make_index_sequence<size_>())) array_type;
 
-    void *tuple_offset(size_t i) const {
-        return value_.offsets_[i];
+    static void *tuple_offset(const TUPLE *tuple, size_t i) {
+        return array_type::elements_[i < size_ ? i : size_](tuple);
     }
 };
 
 template<typename TUPLE>
-struct offset_tuple_impl<TUPLE, 0> {
-    offset_tuple_impl(const TUPLE *tuple) {
-    }
-    void *tuple_offset(size_t i) const {
-        return nullptr;
-    }
-};
+template<std::size_t... I>
+constexpr typename offset_tuple_impl<TUPLE>::element_t
+    offset_tuple_impl<TUPLE>::element_array<I...>::elements_[offset_tuple_impl<TUPLE>::size_ + 1];
 
 template<typename NOT_TUPLE>
-struct offset_tuple
-    : public offset_tuple_impl<NOT_TUPLE, 0> {
-    offset_tuple(const NOT_TUPLE *tuple)
-        : offset_tuple_impl<NOT_TUPLE, 0>(tuple) {
+struct offset_tuple {
+    static void *tuple_offset(const NOT_TUPLE *tuple, size_t i) {
+        return nullptr;
     }
 };
 
 template<typename ...T>
 struct offset_tuple<std::tuple<T...>>
-    : public offset_tuple_impl<std::tuple<T...>, std::tuple_size<std::tuple<T...>>::value> {
-    offset_tuple(const std::tuple<T...> *tuple)
-        : offset_tuple_impl<std::tuple<T...>, std::tuple_size<std::tuple<T...>>::value>(tuple) {
-    }
+    : public offset_tuple_impl<std::tuple<T...>> {
 };
 
-template<typename TUPLE, std::size_t SIZE>
-struct type_tuple_impl {
-    template<size_t I_SIZE, std::size_t... I>
-    struct type_index_array {
-        std::type_index types_[I_SIZE];
-        std::type_index types_rcv_[I_SIZE];
-
-        type_index_array()
-            : types_{ get_type_index(typeid(typename std::tuple_element<I, TUPLE>::type))... }
-            , types_rcv_{ get_type_index(typeid(typename remove_rcv<typename std::tuple_element<I, TUPLE>::type>::type))... } {
-        }
-    };
-
-    template<std::size_t... I>
-    static type_index_array<SIZE, I...> get_array(const std::index_sequence<I...> &) {
-        return type_index_array<SIZE, I...>();
+/* The types of the elements of a tuple, and with the references and cv
+   removed, as tables in flash. The entry after the last one is void. */
+template<typename NOT_TUPLE>
+struct type_tuple {
+    static const std::size_t size_ = 0;
+    static pm_type_id tuple_type(size_t i) {
+        return pm_type_of<void>();
     }
-
-    decltype(get_array(std::make_index_sequence<SIZE>())) value_;
-
-    type_tuple_impl()
-        : value_(get_array(std::make_index_sequence<SIZE>())) {
+    static pm_type_id tuple_rcv_type(size_t i) {
+        return pm_type_of<void>();
     }
+};
 
-    std::type_index tuple_type(size_t i) const {
-        return value_.types_[i];
-    }
+template<typename ...T>
+struct type_tuple<std::tuple<T...>> {
+    static const std::size_t size_ = sizeof...(T);
 
-    std::type_index tuple_rcv_type(size_t i) const {
-        return value_.types_rcv_[i];
-    }
-};
+    static constexpr pm_type_id types_[sizeof...(T) + 1] = {
+        pm_type_of<T>()..., pm_type_of<void>()
+    };
+    static constexpr pm_type_id types_rcv_[sizeof...(T) + 1] = {
+        pm_type_of<typename remove_rcv<T>::type>()..., pm_type_of<void>()
+    };
 
-template<typename TUPLE>
-struct type_tuple_impl<TUPLE, 0> {
-    static const std::size_t size_ = 0;
-    std::type_index tuple_type(size_t i) const {
-        return get_type_index(typeid(void));
-    }
-    std::type_index tuple_rcv_type(size_t i) const {
-        return get_type_index(typeid(void));
+    static pm_type_id tuple_type(size_t i) {
+        return types_[i];
     }
-};
 
-template<typename NOT_TUPLE>
-struct type_tuple :
-    public type_tuple_impl<void, 0> {
-    static const std::size_t size_ = 0;
+    static pm_type_id tuple_rcv_type(size_t i) {
+        return types_rcv_[i];
+    }
 };
 
 template<typename ...T>
-struct type_tuple<std::tuple<T...>> :
-    public type_tuple_impl<std::tuple<T...>, std::tuple_size<std::tuple<T...>>::value> {
-    static const std::size_t size_ = std::tuple_size<std::tuple<T...>>::value;
-};
+constexpr pm_type_id type_tuple<std::tuple<T...>>::types_[sizeof...(T) + 1];
+template<typename ...T>
+constexpr pm_type_id type_tuple<std::tuple<T...>>::types_rcv_[sizeof...(T) + 1];
 
 template<typename T>
 struct tuple_remove_reference {
@@ -789,131 +1244,290 @@ struct func_traits {
 };
 
 
-class pm_any {
+class pm_any_placeholder {
 public: // structors
-    pm_any()
-        : content(0) {
-    }
-
-    template<typename ValueType>
-    pm_any(const ValueType & value)
-        : content(pm_new<holder<ValueType>>(value)) {
-    }
-
-    pm_any(const pm_any & other)
-        : content(other.content ? other.content->clone() : 0) {
+    virtual ~pm_any_placeholder() {
     }
 
-    ~pm_any() {
-        if (content != nullptr) {
-            pm_delete(content);
-        }
-    }
-
-public: // modifiers
+public: // queries
+    virtual pm_type_id type() const = 0;
+    virtual std::size_t tuple_size() const = 0;
+    virtual pm_type_id tuple_type(size_t i) const = 0;
+    virtual void *tuple_element(size_t i) const = 0;
 
-    pm_any & swap(pm_any & rhs) {
-        std::swap(content, rhs.content);
-        return *this;
-    }
+    /* Copied or moved into the buffer of a pm_any, or obtained apart if buffer is nullptr */
+    virtual pm_any_placeholder * clone(void *buffer) const = 0;
+    virtual pm_any_placeholder * move(void *buffer) = 0;
+};
 
-    template<typename ValueType>
-    pm_any & operator=(const ValueType & rhs) {
-        pm_any(rhs).swap(*this);
-        return *this;
+template<typename ValueType>
+class pm_any_holder : public pm_any_placeholder {
+public: // structors
+    pm_any_holder(const ValueType & value)
+        : held(value) {
     }
 
-    pm_any & operator=(const pm_any & rhs) {
-        pm_any(rhs).swap(*this);
-        return *this;
+    pm_any_holder(ValueType && value)
+        : held(std::move(value)) {
     }
 
 public: // queries
-    bool empty() const {
-        return !content;
-    }
-    
-    void clear() {
-        pm_any().swap(*this);
+    virtual pm_type_id type() const {
+        return pm_type_of<ValueType>();
     }
 
-    const std::type_info & type() const {
-        return content ? content->type() : typeid(void);
+    virtual std::size_t tuple_size() const {
+        return type_tuple<ValueType>::size_;
     }
 
-    std::size_t tuple_size() const {
-        return content ? content->tuple_size() : 0;
+    virtual pm_type_id tuple_type(size_t i) const {
+        return type_tuple<ValueType>::tuple_type(i);
     }
 
-    std::type_index tuple_type(size_t i) const {
-        return content ? content->tuple_type(i) : get_type_index(typeid(void));
+    virtual void *tuple_element(size_t i) const {
+        return offset_tuple<ValueType>::tuple_offset(&held, i);
     }
 
-    void *tuple_element(size_t i) const {
-        return content ? content->tuple_element(i) : nullptr;
+    virtual pm_any_placeholder * clone(void *buffer) const {
+        if (buffer != nullptr)
+            return new(buffer) pm_any_holder(held);
+        return pm_new<pm_any_holder>(held);
     }
 
-public: // types (public so any_cast can be non-friend)
-    class placeholder {
-    public: // structors
-        virtual ~placeholder() {
-        }
-
-    public: // queries
-        virtual const std::type_info & type() const = 0;
-        virtual std::size_t tuple_size() const = 0;
-        virtual std::type_index tuple_type(size_t i) const = 0;
-        virtual void *tuple_element(size_t i) const = 0;
+    virtual pm_any_placeholder * move(void *buffer) {
+        return new(buffer) pm_any_holder(std::move(held));
+    }
+public: // representation
+    ValueType held;
+private: // intentionally left unimplemented
+    pm_any_holder & operator=(const pm_any_holder &);
+};
 
-        virtual placeholder * clone() const = 0;
+/* The buffer of pm_any holds the holder of a tuple of PM_INLINE_ANY bytes */
+template<size_t SIZE>
+struct pm_any_buffer {
+    struct value_type {
+        void *words_[(SIZE + sizeof(void *) - 1) / sizeof(void *)];
     };
+    static const size_t size_ = sizeof(pm_any_holder<std::tuple<value_type>>);
+};
 
-    template<typename ValueType>
-    class holder : public placeholder {
-    public: // structors
-        holder(const ValueType & value)
-            : held(value)
-            , type_tuple_()
-            , offset_tuple_(&held) {
-        }
+template<>
+struct pm_any_buffer<0> {
+    static const size_t size_ = 0;
+};
 
-    public: // queries
-        virtual const std::type_info & type() const {
-            return typeid(ValueType);
-        }
+/* Values copied and destroyed as bytes when inline in a pm_any, a tuple
+   whose elements are all trivially copyable is, though std::tuple is not */
+template<typename ValueType>
+struct pm_any_trivial : public std::is_trivially_copyable<ValueType> {};
 
-        virtual std::size_t tuple_size() const {
-            return type_tuple_.size_;
-        }
+template<typename ...T>
+struct pm_any_trivial<std::tuple<T...>> : public std::true_type {};
 
-        virtual std::type_index tuple_type(size_t i) const {
-            return type_tuple_.tuple_type(i);
-        }
+template<typename T, typename ...TS>
+struct pm_any_trivial<std::tuple<T, TS...>>
+    : public std::integral_constant<bool, std::is_trivially_copyable<T>::value
+        && pm_any_trivial<std::tuple<TS...>>::value> {};
 
-        virtual void *tuple_element(size_t i) const {
-            return offset_tuple_.tuple_offset(i);
-        }
+class pm_any;
 
-        virtual placeholder * clone() const {
-            return pm_new<holder>(held);
-        }
-    public: // representation
-        ValueType held;
-        type_tuple<ValueType> type_tuple_;
-        offset_tuple<ValueType> offset_tuple_;
-    private: // intentionally left unimplemented
-        holder & operator=(const holder &);
+/* Values other than a pm_any, which is copied or moved as a whole */
+template<typename ValueType>
+using pm_not_any = typename std::enable_if<
+    !std::is_same<typename std::decay<ValueType>::type, pm_any>::value>::type;
+
+class pm_any {
+public: // structors
+    pm_any()
+        : inline_(false)
+        , trivial_(false) {
+        set_ptr(nullptr);
+    }
+
+    template<typename ValueType, typename = pm_not_any<ValueType>>
+    pm_any(ValueType && value)
+        : inline_(false)
+        , trivial_(false) {
+        typedef holder<typename std::decay<ValueType>::type> holder_type;
+        construct<holder_type>(std::forward<ValueType>(value), std::integral_constant<bool, fits<holder_type>::value>());
+    }
+
+    pm_any(const pm_any & other)
+        : inline_(false)
+        , trivial_(false) {
+        copy_from(other);
+    }
+
+    pm_any(pm_any && other)
+        : inline_(false)
+        , trivial_(false) {
+        set_ptr(nullptr);
+        move_from(other);
+    }
+
+    ~pm_any() {
+        reset();
+    }
+
+public: // modifiers
+
+    pm_any & swap(pm_any & rhs) {
+        pm_any tmp(std::move(rhs));
+        rhs.move_from(*this);
+        move_from(tmp);
+        return *this;
+    }
+
+    /* The value is built in place, rhs must not be a part of this */
+    template<typename ValueType, typename = pm_not_any<ValueType>>
+    pm_any & operator=(ValueType && rhs) {
+        typedef holder<typename std::decay<ValueType>::type> holder_type;
+        reset();
+        construct<holder_type>(std::forward<ValueType>(rhs), std::integral_constant<bool, fits<holder_type>::value>());
+        return *this;
+    }
+
+    pm_any & operator=(const pm_any & rhs) {
+        if (this != &rhs) {
+            reset();
+            copy_from(rhs);
+        }
+        return *this;
+    }
+
+    pm_any & operator=(pm_any && rhs) {
+        if (this != &rhs) {
+            reset();
+            move_from(rhs);
+        }
+        return *this;
+    }
+
+public: // queries
+    bool empty() const {
+        return content() == nullptr;
+    }
+    
+    void clear() {
+        reset();
+    }
+
+    pm_type_id type() const {
+        return !empty() ? content()->type() : pm_type_of<void>();
+    }
+
+    std::size_t tuple_size() const {
+        return !empty() ? content()->tuple_size() : 0;
+    }
+
+    pm_type_id tuple_type(size_t i) const {
+        return !empty() ? content()->tuple_type(i) : pm_type_of<void>();
+    }
+
+    void *tuple_element(size_t i) const {
+        return !empty() ? content()->tuple_element(i) : nullptr;
+    }
+
+public: // types (public so any_cast can be non-friend)
+    typedef pm_any_placeholder placeholder;
+
+    template<typename ValueType>
+    using holder = pm_any_holder<ValueType>;
+
+    placeholder *content() const {
+        if (inline_)
+            return reinterpret_cast<placeholder *>(const_cast<unsigned char *>(buffer_));
+        return *reinterpret_cast<const pm_arena_ptr<placeholder> *>(buffer_);
+    }
+
+private:
+    static const size_t buffer_size = pm_any_buffer<PM_INLINE_ANY>::size_;
+
+    template<typename HOLDER>
+    struct fits {
+        static const bool value = (sizeof(HOLDER) <= buffer_size && alignof(HOLDER) <= alignof(void *));
     };
 
-public: // representation (public so any_cast can be non-friend)
-    placeholder * content;
+    template<typename HOLDER, typename ValueType>
+    void construct(ValueType && value, std::true_type) {
+        new(buffer_) HOLDER(std::forward<ValueType>(value));
+        inline_ = true;
+        trivial_ = pm_any_trivial<typename std::decay<ValueType>::type>::value;
+    }
+
+    template<typename HOLDER, typename ValueType>
+    void construct(ValueType && value, std::false_type) {
+        set_ptr(pm_new<HOLDER>(std::forward<ValueType>(value)));
+    }
+
+    void set_ptr(placeholder *content) {
+        new(buffer_) pm_arena_ptr<placeholder>(content);
+    }
+
+    /* Copies the holder with its vtable pointer as bytes, no virtual call */
+    void copy_trivial(const pm_any & other) {
+        std::memcpy(buffer_, other.buffer_, sizeof(buffer_));
+        inline_ = true;
+        trivial_ = true;
+    }
+
+    /* Copies or takes the value of other, this is empty */
+    void copy_from(const pm_any & other) {
+        if (other.trivial_) {
+            copy_trivial(other);
+            return;
+        }
+        placeholder *content = other.content();
+        inline_ = other.inline_;
+        if (inline_)
+            content->clone(buffer_);
+        else
+            set_ptr(content ? content->clone(nullptr) : nullptr);
+    }
+
+    void move_from(pm_any & other) {
+        if (other.trivial_) {
+            copy_trivial(other);
+            other.inline_ = false;
+            other.trivial_ = false;
+            other.set_ptr(nullptr);
+        }
+        else if (other.inline_) {
+            other.content()->move(buffer_);
+            inline_ = true;
+            other.reset();
+        }
+        else {
+            set_ptr(other.content());
+            other.set_ptr(nullptr);
+        }
+    }
+
+    void reset() {
+        placeholder *content = this->content();
+        if (inline_) {
+            if (!trivial_)
+                content->~placeholder();
+        }
+        else if (content != nullptr)
+            pm_delete(content);
+        inline_ = false;
+        trivial_ = false;
+        set_ptr(nullptr);
+    }
+
+    alignas(void *) unsigned char buffer_[buffer_size > sizeof(pm_arena_ptr<placeholder>)
+        ? buffer_size : sizeof(pm_arena_ptr<placeholder>)];
+    bool inline_;
+    bool trivial_;      /* Inline, and pm_any_trivial */
 };
 
 class bad_any_cast : public std::bad_cast {
 public:
-    std::type_index from_;
-    std::type_index to_;
-    bad_any_cast(const std::type_index &from, const std::type_index &to)
+    pm_type_id from_;
+    pm_type_id to_;
+    bad_any_cast(pm_type_id from, pm_type_id to)
         : from_(from)
         , to_(to) {
     }
@@ -926,8 +1540,8 @@ template<typename ValueType>
 ValueType * any_cast(pm_any *operand) {
     typedef typename pm_any::template holder<ValueType> holder_t;
     return operand &&
-        operand->type() == typeid(ValueType)
-        ? &static_cast<holder_t *>(operand->content)->held
+        operand->type() == pm_type_of<ValueType>()
+        ? &static_cast<holder_t *>(operand->content())->held
         : 0;
 }
 
@@ -942,7 +1556,7 @@ ValueType any_cast(pm_any & operand) {
 
     nonref * result = any_cast<nonref>(&operand);
     if (!result)
-        pm_throw(bad_any_cast(get_type_index(operand.type()), get_type_index(typeid(ValueType))));
+        pm_throw(bad_any_cast(operand.type(), pm_type_of<ValueType>()));
     return *result;
 }
 
@@ -952,6 +1566,23 @@ inline ValueType any_cast(const pm_any &operand) {
     return any_cast<const nonref &>(const_cast<pm_any &>(operand));
 }
 
+/* Results of any_cast() without exceptions */
+enum any_cast_status {
+    kAnyCastOk = 0,
+    kAnyCastEmpty,
+    kAnyCastBadType
+};
+
+/* Copies the value of operand to value, or returns why it can not */
+template<typename ValueType>
+inline any_cast_status any_cast(const pm_any &operand, ValueType &value) {
+    const ValueType *result = any_cast<ValueType>(&operand);
+    if (result == nullptr)
+        return operand.empty() ? kAnyCastEmpty : kAnyCastBadType;
+    value = *result;
+    return kAnyCastOk;
+}
+
 // Copyright Kevlin Henney, 2000, 2001, 2002. All rights reserved.
 //
 // Distributed under the Boost Software License, Version 1.0. (See
@@ -960,27 +1591,70 @@ inline ValueType any_cast(const pm_any &operand) {
 
 
 
-template<typename RET, typename FUNC, std::size_t ...I>
+/* A value passed to a parameter of type PARAM. If MOVE, the value is not
+   used after the call, and parameters taken by value or by rvalue reference
+   get it moved. Otherwise they get a copy */
+template<bool MOVE, typename PARAM>
+struct arg_pass {
+    template<typename T>
+    static T &&get(T &value) {
+        return std::move(value);
+    }
+};
+
+template<typename PARAM>
+struct arg_pass<true, PARAM &> {
+    template<typename T>
+    static T &get(T &value) {
+        return value;
+    }
+};
+
+template<typename PARAM>
+struct arg_pass<false, PARAM> {
+    template<typename T>
+    static T &get(T &value) {
+        return value;
+    }
+};
+
+template<typename PARAM>
+struct arg_pass<false, PARAM &&> {
+    template<typename T>
+    static T get(T &value) {
+        return value;
+    }
+};
+
+template<bool MOVE, std::size_t I, typename FUNC>
+struct func_arg_pass
+    : public arg_pass<MOVE, typename std::tuple_element<I, typename func_traits_impl<FUNC>::arg_type>::type> {
+};
+
+/* Calls func with the values in arg. If MOVE, they are moved to the
+   function as they can be, and arg is cleared after the call */
+template<bool MOVE, typename RET, typename FUNC, std::size_t ...I>
 struct call_tuple_t {
     typedef typename func_traits<FUNC>::arg_type func_arg_type;
     typedef typename remove_reference_tuple<std::tuple<RET>>::type ret_type;
     
     static ret_type call(const FUNC &func, pm_any &arg) {
-        func_arg_type new_arg(*reinterpret_cast<typename std::tuple_element<I, func_arg_type>::type *>(arg.tuple_element(I))...);
-        arg.clear();
-        return ret_type(func(std::get<I>(new_arg)...));
+        ret_type ret(func(func_arg_pass<MOVE, I, FUNC>::get(
+            *reinterpret_cast<typename std::tuple_element<I, func_arg_type>::type *>(arg.tuple_element(I)))...));
+        if (MOVE) arg.clear();
+        return ret;
     }
 };
 
-template<typename FUNC, std::size_t ...I>
-struct call_tuple_t<void, FUNC, I...> {
+template<bool MOVE, typename FUNC, std::size_t ...I>
+struct call_tuple_t<MOVE, void, FUNC, I...> {
     typedef typename func_traits<FUNC>::arg_type func_arg_type;
     typedef std::tuple<> ret_type;
 
     static std::tuple<> call(const FUNC &func, pm_any &arg) {
-        func_arg_type new_arg(*reinterpret_cast<typename std::tuple_element<I, func_arg_type>::type *>(arg.tuple_element(I))...);
-        arg.clear();
-        func(std::get<I>(new_arg)...);
+        func(func_arg_pass<MOVE, I, FUNC>::get(
+            *reinterpret_cast<typename std::tuple_element<I, func_arg_type>::type *>(arg.tuple_element(I)))...);
+        if (MOVE) arg.clear();
         return std::tuple<>();
     }
 };
@@ -995,13 +1669,13 @@ struct call_tuple_ret_t<void> {
     typedef std::tuple<> ret_type;
 };
 
-template<typename FUNC, std::size_t ...I>
+template<bool MOVE, typename FUNC, std::size_t ...I>
 inline auto call_tuple_as_argument(const FUNC &func, pm_any &arg, const std::index_sequence<I...> &) 
     -> typename call_tuple_ret_t<typename func_traits<FUNC>::ret_type>::ret_type
 {
     typedef typename func_traits<FUNC>::ret_type ret_type;
 
-    return call_tuple_t<ret_type, FUNC, I...>::call(func, arg);
+    return call_tuple_t<MOVE, ret_type, FUNC, I...>::call(func, arg);
 }
 
 template<typename FUNC>
@@ -1011,13 +1685,12 @@ inline bool verify_func_arg(const FUNC &func, pm_any &arg) {
 
     if (arg.tuple_size() < tuple_func.size_) {
         return false;
-        //pm_throw(bad_any_cast(std::type_index(arg.type()), get_type_index(typeid(func_arg_type))));
+        //pm_throw(bad_any_cast(arg.type(), pm_type_of<func_arg_type>()));
     }
 
     for (size_t i = tuple_func.size_; i-- != 0; ) {
         if (arg.tuple_type(i) != tuple_func.tuple_type(i)
             && arg.tuple_type(i) != tuple_func.tuple_rcv_type(i)) {
-            //printf("== %s ==> %s\n", arg.tuple_type(i).name(), tuple_func.tuple_type(i).name());
             return false;
             //pm_throw(bad_any_cast(arg.tuple_type(i), tuple_func.tuple_type(i)));
         }
@@ -1026,14 +1699,16 @@ inline bool verify_func_arg(const FUNC &func, pm_any &arg) {
     return true;
 }
 
-template<typename FUNC>
+/* Calls func with the values in arg. By default the values are moved to
+   func and arg is cleared; call_func<false> leaves them in arg */
+template<bool MOVE = true, typename FUNC>
 inline auto call_func(const FUNC &func, pm_any &arg)
     -> typename call_tuple_ret_t<typename func_traits<FUNC>::ret_type>::ret_type
 {
     typedef typename func_traits<FUNC>::arg_type func_arg_type;
     //type_tuple<func_arg_type> tuple_func;
 
-    return call_tuple_as_argument(func, arg, std::make_index_sequence<type_tuple<func_arg_type>::size_>());
+    return call_tuple_as_argument<MOVE>(func, arg, std::make_index_sequence<type_tuple<func_arg_type>::size_>());
 }
 
 struct Bypass {};
@@ -1043,7 +1718,7 @@ template< class T >
 class pm_shared_ptr {
 public:
     ~pm_shared_ptr() {
-        pm_allocator::dec_ref(object_);
+        pm_allocator::dec_ref(object_.get());
     }
 
     explicit pm_shared_ptr(T *object)
@@ -1056,7 +1731,12 @@ public:
 
     pm_shared_ptr(pm_shared_ptr const &ptr)
         : object_(ptr.object_) {
-        pm_allocator::add_ref(object_);
+        pm_allocator::add_ref(object_.get());
+    }
+
+    pm_shared_ptr(pm_shared_ptr &&ptr)
+        : object_(ptr.object_) {
+        ptr.object_ = nullptr;
     }
 
     pm_shared_ptr &operator=(pm_shared_ptr const &ptr) {
@@ -1064,6 +1744,11 @@ public:
         return *this;
     }
 
+    pm_shared_ptr &operator=(pm_shared_ptr &&ptr) {
+        pm_shared_ptr(std::move(ptr)).swap(*this);
+        return *this;
+    }
+
     bool operator==(pm_shared_ptr const &ptr) const {
         return object_ == ptr.object_;
     }
@@ -1085,12 +1770,12 @@ public:
     }
 
     inline T *obtain_rawptr() {
-        pm_allocator::add_ref(object_);
+        pm_allocator::add_ref(object_.get());
         return object_;
     }
 
     inline void release_rawptr() {
-        pm_allocator::dec_ref(object_);
+        pm_allocator::dec_ref(object_.get());
     }
 
     void clear() {
@@ -1103,17 +1788,17 @@ public:
         std::swap(object_, ptr.object_);
     }
 
-    T *object_;
+    pm_arena_ptr<T> object_;
 };
 
 template< class T, class... Args >
 inline pm_shared_ptr<T> pm_make_shared(Args&&... args) {
-    return pm_shared_ptr<T>(pm_new<T>(args...));
+    return pm_shared_ptr<T>(pm_new<T>(std::forward<Args>(args)...));
 }
 
 template< class T, class B, class... Args >
 inline pm_shared_ptr<B> pm_make_shared2(Args&&... args) {
-    return pm_shared_ptr<B>(pm_new<T>(args...));
+    return pm_shared_ptr<B>(pm_new<T>(std::forward<Args>(args)...));
 }
 
 
@@ -1122,7 +1807,7 @@ class pm_shared_ptr_promise {
     typedef pm_shared_ptr_promise Defer;
 public:
     ~pm_shared_ptr_promise() {
-        pm_allocator::dec_ref(object_);
+        pm_allocator::dec_ref(object_.get());
     }
 
     explicit pm_shared_ptr_promise(T *object)
@@ -1135,12 +1820,17 @@ public:
 
     pm_shared_ptr_promise(pm_shared_ptr_promise const &ptr)
         : object_(ptr.object_) {
-        pm_allocator::add_ref(object_);
+        pm_allocator::add_ref(object_.get());
+    }
+
+    pm_shared_ptr_promise(pm_shared_ptr_promise &&ptr)
+        : object_(ptr.object_) {
+        ptr.object_ = nullptr;
     }
 
     pm_shared_ptr_promise(pm_shared_ptr<T> const &ptr)
         : object_(ptr.object_) {
-        pm_allocator::add_ref(object_);
+        pm_allocator::add_ref(object_.get());
     }
 
     Defer &operator=(Defer const &ptr) {
@@ -1148,6 +1838,11 @@ public:
         return *this;
     }
 
+    Defer &operator=(Defer &&ptr) {
+        Defer(std::move(ptr)).swap(*this);
+        return *this;
+    }
+
     bool operator==(Defer const &ptr) const {
         return object_ == ptr.object_;
     }
@@ -1169,12 +1864,12 @@ public:
     }
 
     inline T *obtain_rawptr() {
-        pm_allocator::add_ref(object_);
+        pm_allocator::add_ref(object_.get());
         return object_;
     }
 
     inline void release_rawptr() {
-        pm_allocator::dec_ref(object_);
+        pm_allocator::dec_ref(object_.get());
     }
 
     Defer find_pending() const {
@@ -1191,13 +1886,13 @@ public:
     }
 
     template <typename ...RET_ARG>
-    void resolve(const RET_ARG &... ret_arg) const {
-        object_->template resolve<RET_ARG...>(ret_arg...);
+    void resolve(RET_ARG &&... ret_arg) const {
+        object_->resolve(std::forward<RET_ARG>(ret_arg)...);
     }
 
     template <typename ...RET_ARG>
-    void reject(const RET_ARG &... ret_arg) const {
-        object_->template reject<RET_ARG...>(ret_arg...);
+    void reject(RET_ARG &&... ret_arg) const {
+        object_->reject(std::forward<RET_ARG>(ret_arg)...);
     }
 
     Defer then(Defer &promise) {
@@ -1206,17 +1901,17 @@ public:
 
     template <typename FUNC_ON_RESOLVED, typename FUNC_ON_REJECTED>
     Defer then(FUNC_ON_RESOLVED on_resolved, FUNC_ON_REJECTED on_rejected) const {
-        return object_->template then<FUNC_ON_RESOLVED, FUNC_ON_REJECTED>(on_resolved, on_rejected);
+        return object_->template then<FUNC_ON_RESOLVED, FUNC_ON_REJECTED>(std::move(on_resolved), std::move(on_rejected));
     }
 
     template <typename FUNC_ON_RESOLVED>
     Defer then(FUNC_ON_RESOLVED on_resolved) const {
-        return object_->template then<FUNC_ON_RESOLVED>(on_resolved);
+        return object_->template then<FUNC_ON_RESOLVED>(std::move(on_resolved));
     }
 
     template <typename FUNC_ON_REJECTED>
     Defer fail(FUNC_ON_REJECTED on_rejected) const {
-        return object_->template fail<FUNC_ON_REJECTED>(on_rejected);
+        return object_->template fail<FUNC_ON_REJECTED>(std::move(on_rejected));
     }
 
     template <typename FUNC_ON_ALWAYS>
@@ -1234,7 +1929,7 @@ private:
         std::swap(object_, ptr.object_);
     }
 
-    T *object_;
+    pm_arena_ptr<T> object_;
 };
 
 typedef pm_shared_ptr_promise<Promise> Defer;
@@ -1249,11 +1944,26 @@ struct RejectChecker;
 
 
 inline Defer newHeadPromise(void);
+inline void typed_box(Promise *promise);
+inline void typed_clear(Promise *promise);
+
+#ifdef PM_NO_VTABLE
+#define PM_VIRTUAL
 
+/* Base of the callers, which are called through Promise::invoke_ */
 struct PromiseCaller{
+    static const bool reads_in_place = false;
+};
+#else
+#define PM_VIRTUAL virtual
+
+struct PromiseCaller{
+    /* The caller reads the value of a TypedPromise in place of any_ */
+    static const bool reads_in_place = false;
     virtual ~PromiseCaller(){};
     virtual Defer call(Defer &self, Promise *caller) = 0;
 };
+#endif
 
 template <typename FUNC_ON_RESOLVED>
 struct ResolvedCaller
@@ -1261,10 +1971,10 @@ struct ResolvedCaller
     typedef typename func_traits<FUNC_ON_RESOLVED>::ret_type resolve_ret_type;
     FUNC_ON_RESOLVED on_resolved_;
 
-    ResolvedCaller(const FUNC_ON_RESOLVED &on_resolved)
-        : on_resolved_(on_resolved){}
+    ResolvedCaller(FUNC_ON_RESOLVED on_resolved)
+        : on_resolved_(std::move(on_resolved)){}
 
-    virtual Defer call(Defer &self, Promise *caller) {
+    PM_VIRTUAL Defer call(Defer &self, Promise *caller) {
         return ResolveChecker<resolve_ret_type, FUNC_ON_RESOLVED>::call(on_resolved_, self, caller);
     }
 };
@@ -1275,20 +1985,94 @@ struct RejectedCaller
     typedef typename func_traits<FUNC_ON_REJECTED>::ret_type reject_ret_type;
     FUNC_ON_REJECTED on_rejected_;
 
-    RejectedCaller(const FUNC_ON_REJECTED &on_rejected)
-        : on_rejected_(on_rejected){}
+    RejectedCaller(FUNC_ON_REJECTED on_rejected)
+        : on_rejected_(std::move(on_rejected)){}
 
-    virtual Defer call(Defer &self, Promise *caller) {
+    PM_VIRTUAL Defer call(Defer &self, Promise *caller) {
         return RejectChecker<reject_ret_type, FUNC_ON_REJECTED>::call(on_rejected_, self, caller);
     }
 };
 
+/* Makes the caller of then(), in the block of the promise or obtained apart.
+   CALLER is void if there is no function */
+template <typename CALLER>
+struct caller_maker {
+    /* Bytes taken in the block of the promise */
+    static const size_t size = (sizeof(CALLER) + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+    /* The block of the promise is aligned as a pointer */
+    static const bool fits = (alignof(CALLER) <= alignof(void *));
+    static const bool reads_in_place = CALLER::reads_in_place;
+
+    template <typename FUNC>
+    static PromiseCaller *make(void *buf, FUNC &&func) {
+        return new(buf) CALLER(std::forward<FUNC>(func));
+    }
+
+    template <typename FUNC>
+    static PromiseCaller *obtain(FUNC &&func) {
+        return pm_new<CALLER>(std::forward<FUNC>(func));
+    }
+
+#ifdef PM_NO_VTABLE
+    static Defer call(PromiseCaller *callee, Defer &self, Promise *caller) {
+        return static_cast<CALLER *>(callee)->call(self, caller);
+    }
+
+    static void destroy(PromiseCaller *caller, bool in_block) {
+        if (in_block)
+            static_cast<CALLER *>(caller)->~CALLER();
+        else
+            pm_delete(static_cast<CALLER *>(caller));
+    }
+#endif
+};
+
+template <>
+struct caller_maker<void> {
+    static const size_t size = 0;
+    static const bool fits = true;
+    static const bool reads_in_place = false;
+
+    template <typename FUNC>
+    static PromiseCaller *make(void *, const FUNC &) {
+        return nullptr;
+    }
+
+    template <typename FUNC>
+    static PromiseCaller *obtain(const FUNC &) {
+        return nullptr;
+    }
+
+#ifdef PM_NO_VTABLE
+    static Defer call(PromiseCaller *, Defer &self, Promise *) {
+        return self;
+    }
+
+    static void destroy(PromiseCaller *, bool) {
+    }
+#endif
+};
+
+template <bool INLINE, size_t SIZE, typename NODE = Promise>
+struct caller_node;
+
 struct Promise {
     Defer next_;
     pm_stack::itr_t prev_;
     pm_any any_;
-    PromiseCaller *resolved_;
-    PromiseCaller *rejected_;
+#ifdef PM_NO_VTABLE
+    /* Calls on_resolved or on_rejected of then(), and destroys both */
+    Defer (*invoke_)(Promise *promise, bool rejected, Defer &self, Promise *caller);
+    void (*destroy_)(Promise *promise);
+#else
+    pm_arena_ptr<PromiseCaller> resolved_;
+    pm_arena_ptr<PromiseCaller> rejected_;
+#endif
+    /* Link in the ready list, timer list or irq waiting list,
+       pm_stack::itr_t drops the low address bits so it is aligned as a pointer */
+    alignas(void *) pm_list list_;
+    /* The other end of the chain, kept by its head and its tail only */
+    pm_stack::itr_t end_;
 
     enum status_t {
         kInit       = 0,
@@ -1296,7 +2080,21 @@ struct Promise {
         kRejected   = 2,
         kFinished   = 3
     };
-    uint8_t status_      ;//: 2;
+    /* Bit fields share a byte, so end_ takes no room after list_ */
+    uint8_t status_     : 2;
+#ifdef PM_NO_VTABLE
+    enum caller_t {
+        kResolvedCaller = 1,
+        kRejectedCaller = 2
+    };
+    uint8_t callers_    : 2;    /* Functions of then() called by invoke_ */
+#else
+    uint8_t inline_     : 1;    /* The callers are in the block of the promise */
+#endif
+    uint8_t typed_      : 1;    /* It is a TypedPromise */
+    uint8_t in_place_   : 1;    /* Its resolved value is in the TypedPromise, not in any_ */
+    uint8_t reads_in_place_ : 1;    /* The function of then() reads the value of a TypedPromise */
+    uint8_t priority_;
 
 #ifdef PM_DEBUG
     uint32_t type_;
@@ -1306,9 +2104,25 @@ struct Promise {
     explicit Promise()
         : next_(nullptr)
         , prev_(pm_stack::ptr_to_itr(nullptr))
+#ifdef PM_NO_VTABLE
+        , invoke_(nullptr)
+        , destroy_(nullptr)
+#else
         , resolved_(nullptr)
         , rejected_(nullptr)
+#endif
+        , list_()
+        , end_(pm_stack::ptr_to_itr(nullptr))
         , status_(kInit)
+#ifdef PM_NO_VTABLE
+        , callers_(0)
+#else
+        , inline_(0)
+#endif
+        , typed_(0)
+        , in_place_(0)
+        , reads_in_place_(0)
+        , priority_(current_priority())
 #ifdef PM_DEBUG
         , type_(PM_TYPE_NONE)
 #endif
@@ -1316,53 +2130,82 @@ struct Promise {
         //printf("size promise = %d %d %d\n", (int)sizeof(*this), (int)sizeof(prev_), (int)sizeof(next_));
     }
 
-    virtual ~Promise() {
+    /* Classes derived from Promise must not need their destructor with PM_NO_VTABLE */
+    PM_VIRTUAL ~Promise() {
         clear_func();
-        if (next_.operator->()) {
-            next_->prev_ = pm_stack::ptr_to_itr(nullptr);
+        if (in_place_)
+            typed_clear(this);
+        /* The rest of the chain is released in this loop instead of the
+           destructors calling each other, the stack does not grow with its length */
+        Promise *tail = get_tail(this);
+        Defer next(std::move(next_));
+        while (next.operator->() != nullptr) {
+            next->prev_ = pm_stack::ptr_to_itr(nullptr);
+            if (pm_allocator::ref_count(next.operator->()) != 1) {
+                /* It is held elsewhere and becomes the head */
+                if (next.operator->() != tail)
+                    set_ends(next.operator->(), tail);
+                break;
+            }
+            Defer after(std::move(next->next_));
+            next = std::move(after);
         }
     }
 
+    /* Priority of new promises, inherited from the promise being run */
+    static uint8_t &current_priority() {
+        static uint8_t priority = 0;
+        return priority;
+    }
+
     template <typename RET_ARG>
-    void prepare_resolve(const RET_ARG &ret_arg) {
+    void prepare_resolve(RET_ARG &&ret_arg) {
         if (status_ != kInit) return;
         status_ = kResolved;
-        any_ = ret_arg;
+        any_ = std::forward<RET_ARG>(ret_arg);
     }
 
     template <typename ...RET_ARG>
-    void resolve(const RET_ARG &... ret_arg) {
-        typedef typename remove_reference_tuple<std::tuple<RET_ARG...>>::type arg_type;
-        prepare_resolve(arg_type(ret_arg...));
+    void resolve(RET_ARG &&... ret_arg) {
+        typedef typename remove_reference_tuple<std::tuple<typename std::remove_reference<RET_ARG>::type...>>::type arg_type;
+        prepare_resolve(arg_type(std::forward<RET_ARG>(ret_arg)...));
         if(status_ == kResolved)
             call_next();
     }
 
     template <typename RET_ARG>
-    void prepare_reject(const RET_ARG &ret_arg) {
+    void prepare_reject(RET_ARG &&ret_arg) {
         if (status_ != kInit) return;
         status_ = kRejected;
-        any_ = ret_arg;
+        any_ = std::forward<RET_ARG>(ret_arg);
     }
 
     template <typename ...RET_ARG>
-    void reject(const RET_ARG &...ret_arg) {
-        typedef typename remove_reference_tuple<std::tuple<RET_ARG...>>::type arg_type;
-        prepare_reject(arg_type(ret_arg...));
+    void reject(RET_ARG &&...ret_arg) {
+        typedef typename remove_reference_tuple<std::tuple<typename std::remove_reference<RET_ARG>::type...>>::type arg_type;
+        prepare_reject(arg_type(std::forward<RET_ARG>(ret_arg)...));
         if(status_ == kRejected)
             call_next();
     }
 
     Defer call_resolve(Defer &self, Promise *caller){
+#ifdef PM_NO_VTABLE
+        if((callers_ & kResolvedCaller) == 0){
+#else
         if(resolved_ == nullptr){
-            self->prepare_resolve(caller->any_);
+#endif
+            self->prepare_resolve(std::move(caller->any_));
             return self;
         }
         ++g_promise_call_len;
 #ifdef PM_MAX_CALL_LEN
         if(g_promise_call_len > PM_MAX_CALL_LEN) pm_throw("PM_MAX_CALL_LEN");
 #endif
+#ifdef PM_NO_VTABLE
+        Defer ret = invoke_(this, false, self, caller);
+#else
         Defer ret = resolved_->call(self, caller);
+#endif
         --g_promise_call_len;
         if (ret != self) {
             joinDeferObject(self, ret);
@@ -1372,15 +2215,23 @@ struct Promise {
     }
 
     Defer call_reject(Defer &self, Promise *caller){
+#ifdef PM_NO_VTABLE
+        if((callers_ & kRejectedCaller) == 0){
+#else
         if(rejected_ == nullptr){
-            self->prepare_reject(caller->any_);
+#endif
+            self->prepare_reject(std::move(caller->any_));
             return self;
         }
         ++g_promise_call_len;
 #ifdef PM_MAX_CALL_LEN
         if(g_promise_call_len > PM_MAX_CALL_LEN) pm_throw("PM_MAX_CALL_LEN");
 #endif
+#ifdef PM_NO_VTABLE
+        Defer ret = invoke_(this, true, self, caller);
+#else
         Defer ret = rejected_->call(self, caller);
+#endif
         --g_promise_call_len;
         if (ret != self) {
             joinDeferObject(self, ret);
@@ -1390,10 +2241,26 @@ struct Promise {
     }
 
     void clear_func() {
-        pm_delete(resolved_);
+#ifdef PM_NO_VTABLE
+        void (*destroy)(Promise *promise) = destroy_;
+        invoke_ = nullptr;
+        destroy_ = nullptr;
+        callers_ = 0;
+        if (destroy != nullptr)
+            destroy(this);
+#else
+        if (inline_) {
+            /* The block is released with the promise */
+            if (resolved_ != nullptr) resolved_->~PromiseCaller();
+            if (rejected_ != nullptr) rejected_->~PromiseCaller();
+        }
+        else {
+            pm_delete(resolved_.get());
+            pm_delete(rejected_.get());
+        }
         resolved_ = nullptr;
-        pm_delete(rejected_);
         rejected_ = nullptr;
+#endif
     }
 
     template <typename FUNC>
@@ -1411,46 +2278,53 @@ struct Promise {
 #endif
     }
     
+    /* Run the function of next_ for the status of this promise, return the
+       promise it returned, or an empty Defer if there is nothing to run */
+    Defer call_next_once() {
+        if((status_ != kResolved && status_ != kRejected) || next_.operator->() == nullptr)
+            return Defer();
+        pm_allocator::add_ref(this);
+        bool rejected = (status_ == kRejected);
+        status_ = kFinished;
+        /* The value of a TypedPromise is put into any_ only for a function
+           which does not read it in place */
+        if (in_place_ && !next_->reads_in_place_)
+            typed_box(this);
+        Defer d = rejected ? next_->call_reject(next_, this) : next_->call_resolve(next_, this);
+        this->any_.clear();
+        if (in_place_)
+            typed_clear(this);
+        /* next_ is empty if its function cut the chain, as doLoop() does */
+        if(next_.operator->() != nullptr)
+            next_->clear_func();
+        pm_allocator::dec_ref(this);
+        return d;
+    }
+
     Defer call_next() {
-        if(status_ == kResolved) {
-            if(next_.operator->()){
-                pm_allocator::add_ref(this);
-                status_ = kFinished;
-                Defer d = next_->call_resolve(next_, this);
-                this->any_.clear();
-                next_->clear_func();
-                if(d.operator->())
-                    d->call_next();
-                //next_.clear();
-                pm_allocator::dec_ref(this);
-                return d;
-            }
-        }
-        else if(status_ == kRejected ) {
-            if(next_.operator->()){
-                pm_allocator::add_ref(this);
-                status_ = kFinished;
-                Defer d =  next_->call_reject(next_, this);
-                this->any_.clear();
-                next_->clear_func();
-                if (d.operator->())
-                    d->call_next();
-                //next_.clear();
-                pm_allocator::dec_ref(this);
-                return d;
-            }
+        if((status_ != kResolved && status_ != kRejected) || next_.operator->() == nullptr)
+            return next_;
+        Defer d = call_next_once();
+        /* The rest of the chain runs in this loop instead of recursion,
+           the stack does not grow with its length */
+        if(d.operator->() != nullptr){
+            Defer p = d->call_next_once();
+            while(p.operator->() != nullptr)
+                p = p->call_next_once();
         }
-
-        return next_;
+        return d;
     }
 
 
+#ifndef PM_NO_VTABLE
     Defer then_impl(PromiseCaller *resolved, PromiseCaller *rejected){
         Defer promise = newHeadPromise();
+        promise->priority_ = priority_;
         promise->resolved_ = resolved;
         promise->rejected_ = rejected;
         return then(promise);
     }
+#endif
 
     Defer then(Defer &promise) {
         joinDeferObject(this, promise);
@@ -1458,22 +2332,37 @@ struct Promise {
         return call_next();
     }
 
+    /* RESOLVED_CALLER or REJECTED_CALLER is void if there is no function,
+       NODE is the type of the new promise */
+    template <typename RESOLVED_CALLER, typename REJECTED_CALLER, typename NODE = Promise, typename FUNC_ON_RESOLVED, typename FUNC_ON_REJECTED>
+    Defer then_callers(FUNC_ON_RESOLVED &&on_resolved, FUNC_ON_REJECTED &&on_rejected) {
+        typedef caller_maker<RESOLVED_CALLER> resolved_maker;
+        typedef caller_maker<REJECTED_CALLER> rejected_maker;
+        enum { size = resolved_maker::size + rejected_maker::size };
+        enum { fits = resolved_maker::fits && rejected_maker::fits && size <= PM_INLINE_CALLER };
+        Defer promise = caller_node<fits, size, NODE>::template
+            make<resolved_maker, rejected_maker>(std::forward<FUNC_ON_RESOLVED>(on_resolved),
+                                                 std::forward<FUNC_ON_REJECTED>(on_rejected));
+        promise->priority_ = priority_;
+        promise->reads_in_place_ = resolved_maker::reads_in_place;
+        return then(promise);
+    }
+
+    /* The functions are taken by value and moved into the callers */
     template <typename FUNC_ON_RESOLVED, typename FUNC_ON_REJECTED>
-    Defer then(const FUNC_ON_RESOLVED &on_resolved, const FUNC_ON_REJECTED &on_rejected) {
-        return then_impl(static_cast<PromiseCaller *>(pm_new<ResolvedCaller<FUNC_ON_RESOLVED>>(on_resolved)),
-                         static_cast<PromiseCaller *>(pm_new<RejectedCaller<FUNC_ON_REJECTED>>(on_rejected)));
+    Defer then(FUNC_ON_RESOLVED on_resolved, FUNC_ON_REJECTED on_rejected) {
+        return then_callers<ResolvedCaller<FUNC_ON_RESOLVED>, RejectedCaller<FUNC_ON_REJECTED>>(
+            std::move(on_resolved), std::move(on_rejected));
     }
 
     template <typename FUNC_ON_RESOLVED>
-    Defer then(const FUNC_ON_RESOLVED &on_resolved) {
-        return then_impl(static_cast<PromiseCaller *>(pm_new<ResolvedCaller<FUNC_ON_RESOLVED>>(on_resolved)),
-                         static_cast<PromiseCaller *>(nullptr));
+    Defer then(FUNC_ON_RESOLVED on_resolved) {
+        return then_callers<ResolvedCaller<FUNC_ON_RESOLVED>, void>(std::move(on_resolved), nullptr);
     }
 
     template <typename FUNC_ON_REJECTED>
-    Defer fail(const FUNC_ON_REJECTED &on_rejected) {
-        return then_impl(static_cast<PromiseCaller *>(nullptr),
-                         static_cast<PromiseCaller *>(pm_new<RejectedCaller<FUNC_ON_REJECTED>>(on_rejected)));
+    Defer fail(FUNC_ON_REJECTED on_rejected) {
+        return then_callers<void, RejectedCaller<FUNC_ON_REJECTED>>(nullptr, std::move(on_rejected));
     }
 
     template <typename FUNC_ON_ALWAYS>
@@ -1485,21 +2374,21 @@ struct Promise {
     Defer finally(const FUNC_ON_FINALLY &on_finally) {
         return then([on_finally](Promise *caller) -> Bypass {
             if(verify_func_arg(on_finally, caller->any_))
-                call_func(on_finally, caller->any_);
+                call_func<false>(on_finally, caller->any_);
             return Bypass();
         }, [on_finally](Defer &self, Promise *caller) -> Bypass {
 #ifndef PM_EMBED
             typedef typename func_traits<FUNC_ON_FINALLY>::arg_type arg_type;
-            if (caller->any_.type() == typeid(std::exception_ptr)) {
+            if (caller->any_.type() == pm_type_of<std::exception_ptr>()) {
                 ExCheck<std::tuple_size<arg_type>::value, FUNC_ON_FINALLY>::call(on_finally, self, caller);
             }
             else {
                 if (verify_func_arg(on_finally, caller->any_))
-                    call_func(on_finally, caller->any_);
+                    call_func<false>(on_finally, caller->any_);
             }
 #else
             if (verify_func_arg(on_finally, caller->any_))
-                call_func(on_finally, caller->any_);
+                call_func<false>(on_finally, caller->any_);
 #endif
             return Bypass();
         });
@@ -1509,6 +2398,10 @@ struct Promise {
     Defer find_pending() {
         if (status_ == kInit) {
             Promise *p = this;
+            /* A chain settles from its head, so the tail of a chain whose
+               head is pending finds it at once */
+            if (next_.operator->() == nullptr && get_head(this)->status_ == kInit)
+                p = get_head(this);
             Promise *prev = static_cast<Promise *>(pm_stack::itr_to_ptr(p->prev_));
             while (prev != nullptr) {
                 if (prev->status_ != kInit)
@@ -1539,7 +2432,21 @@ struct Promise {
             pending.reject();
     }
 
+    static Promise *get_end(Promise *p){
+        return static_cast<Promise *>(pm_stack::itr_to_ptr(p->end_));
+    }
+    static void set_ends(Promise *head, Promise *tail){
+        head->end_ = pm_stack::ptr_to_itr(reinterpret_cast<void *>(tail));
+        tail->end_ = pm_stack::ptr_to_itr(reinterpret_cast<void *>(head));
+    }
+
+    /* The head and the tail of a chain find each other through end_,
+       only a promise in the middle walks the chain */
     static Promise *get_head(Promise *p){
+        if(p->prev_ == pm_stack::ptr_to_itr(nullptr))
+            return p;
+        if(p->next_.operator->() == nullptr)
+            return get_end(p);
         while(p){
             Promise *prev = static_cast<Promise *>(pm_stack::itr_to_ptr(p->prev_));
             if(prev == nullptr) break;
@@ -1548,6 +2455,10 @@ struct Promise {
         return p;
     }
     static Promise *get_tail(Promise *p){
+        if(p->next_.operator->() == nullptr)
+            return p;
+        if(p->prev_ == pm_stack::ptr_to_itr(nullptr))
+            return get_end(p);
         while(p){
             Defer &next = p->next_;
             if(next.operator->() == nullptr) break;
@@ -1555,8 +2466,9 @@ struct Promise {
         }
         return p;
     }
-    
-    
+
+    /* Insert the chain of next after self, both ends of the chain of next
+       are found at once when next is one of them */
     static inline void joinDeferObject(Promise *self, Defer &next){
         /* Check if there's any functions return null Defer object */
         pm_assert(next.operator->() != nullptr);
@@ -1566,19 +2478,119 @@ struct Promise {
 
         if(self->next_.operator->()){
             self->next_->prev_ = pm_stack::ptr_to_itr(reinterpret_cast<void *>(tail));
-            //printf("5prev_ = %d %x\n", (int)self->next_->prev_, pm_stack::itr_to_ptr(self->next_->prev_));
+        }
+        else {
+            /* The chain of self gets a new tail */
+            set_ends(get_head(self), tail);
         }
         tail->next_ = self->next_;
         pm_allocator::add_ref(head);
         self->next_ = Defer(head);
         head->prev_ = pm_stack::ptr_to_itr(reinterpret_cast<void *>(self));
-        //printf("6prev_ = %d %x\n", (int)next->prev_, pm_stack::itr_to_ptr(next->prev_));
     }
 
     static inline void joinDeferObject(Defer &self, Defer &next){
         joinDeferObject(self.operator->(), next);
     }
+
+    /* Cut the chain after self, return the promise that followed it */
+    static inline Defer splitDeferObject(Promise *self){
+        Promise *head = get_head(self);
+        Promise *tail = get_tail(self);
+        Defer next(std::move(self->next_));
+        if(next.operator->() != nullptr){
+            next->prev_ = pm_stack::ptr_to_itr(nullptr);
+            if(head != self)
+                set_ends(head, self);
+            if(next.operator->() != tail)
+                set_ends(next.operator->(), tail);
+        }
+        return next;
+    }
+};
+
+/* Promise followed by the callers of then() */
+template <size_t SIZE, typename NODE = Promise>
+struct CallerPromise : public NODE {
+    void *buf_[SIZE / sizeof(void *)];
+
+    CallerPromise() {
+    }
+};
+
+#ifdef PM_NO_VTABLE
+/* The callers are in buf_, or obtained apart and pointed to by buf_ */
+template <bool INLINE, size_t SIZE, typename NODE>
+struct caller_node {
+    typedef CallerPromise<(INLINE ? SIZE : 2 * sizeof(void *)), NODE> node_type;
+
+    template <typename RESOLVED_MAKER, typename REJECTED_MAKER, typename FUNC_ON_RESOLVED, typename FUNC_ON_REJECTED>
+    static Defer make(FUNC_ON_RESOLVED &&on_resolved, FUNC_ON_REJECTED &&on_rejected) {
+        node_type *promise = pm_new<node_type>();
+        if (INLINE) {
+            char *buf = reinterpret_cast<char *>(promise->buf_);
+            RESOLVED_MAKER::make(buf, std::forward<FUNC_ON_RESOLVED>(on_resolved));
+            REJECTED_MAKER::make(buf + RESOLVED_MAKER::size, std::forward<FUNC_ON_REJECTED>(on_rejected));
+        }
+        else {
+            PromiseCaller **callers = reinterpret_cast<PromiseCaller **>(promise->buf_);
+            callers[0] = RESOLVED_MAKER::obtain(std::forward<FUNC_ON_RESOLVED>(on_resolved));
+            callers[1] = REJECTED_MAKER::obtain(std::forward<FUNC_ON_REJECTED>(on_rejected));
+        }
+        promise->invoke_ = &invoke<RESOLVED_MAKER, REJECTED_MAKER>;
+        promise->destroy_ = &destroy<RESOLVED_MAKER, REJECTED_MAKER>;
+        promise->callers_ = (RESOLVED_MAKER::size != 0 ? Promise::kResolvedCaller : 0)
+                          | (REJECTED_MAKER::size != 0 ? Promise::kRejectedCaller : 0);
+        return Defer(promise);
+    }
+
+    template <typename RESOLVED_MAKER>
+    static PromiseCaller *get(Promise *promise, bool rejected) {
+        void **buf = static_cast<node_type *>(promise)->buf_;
+        if (INLINE)
+            return reinterpret_cast<PromiseCaller *>(reinterpret_cast<char *>(buf) + (rejected ? RESOLVED_MAKER::size : 0));
+        return reinterpret_cast<PromiseCaller **>(buf)[rejected ? 1 : 0];
+    }
+
+    template <typename RESOLVED_MAKER, typename REJECTED_MAKER>
+    static Defer invoke(Promise *promise, bool rejected, Defer &self, Promise *caller) {
+        PromiseCaller *callee = get<RESOLVED_MAKER>(promise, rejected);
+        if (rejected)
+            return REJECTED_MAKER::call(callee, self, caller);
+        return RESOLVED_MAKER::call(callee, self, caller);
+    }
+
+    template <typename RESOLVED_MAKER, typename REJECTED_MAKER>
+    static void destroy(Promise *promise) {
+        RESOLVED_MAKER::destroy(get<RESOLVED_MAKER>(promise, false), INLINE);
+        REJECTED_MAKER::destroy(get<RESOLVED_MAKER>(promise, true), INLINE);
+    }
+};
+#else
+template <size_t SIZE, typename NODE>
+struct caller_node<true, SIZE, NODE> {
+    template <typename RESOLVED_MAKER, typename REJECTED_MAKER, typename FUNC_ON_RESOLVED, typename FUNC_ON_REJECTED>
+    static Defer make(FUNC_ON_RESOLVED &&on_resolved, FUNC_ON_REJECTED &&on_rejected) {
+        CallerPromise<SIZE, NODE> *promise = pm_new<CallerPromise<SIZE, NODE>>();
+        char *buf = reinterpret_cast<char *>(promise->buf_);
+        promise->inline_ = 1;
+        promise->resolved_ = RESOLVED_MAKER::make(buf, std::forward<FUNC_ON_RESOLVED>(on_resolved));
+        promise->rejected_ = REJECTED_MAKER::make(buf + RESOLVED_MAKER::size, std::forward<FUNC_ON_REJECTED>(on_rejected));
+        return Defer(promise);
+    }
+};
+
+template <size_t SIZE, typename NODE>
+struct caller_node<false, SIZE, NODE> {
+    template <typename RESOLVED_MAKER, typename REJECTED_MAKER, typename FUNC_ON_RESOLVED, typename FUNC_ON_REJECTED>
+    static Defer make(FUNC_ON_RESOLVED &&on_resolved, FUNC_ON_REJECTED &&on_rejected) {
+        Defer promise(pm_new<NODE>());
+        promise->resolved_ = RESOLVED_MAKER::obtain(std::forward<FUNC_ON_RESOLVED>(on_resolved));
+        promise->rejected_ = REJECTED_MAKER::obtain(std::forward<FUNC_ON_REJECTED>(on_rejected));
+        return promise;
+    }
 };
+#endif
 
 
 template <typename RET, typename FUNC>
@@ -1589,7 +2601,7 @@ struct ResolveChecker {
             if (verify_func_arg(func, caller->any_))
                 self->prepare_resolve(call_func(func, caller->any_));
             else
-                self->prepare_reject(caller->any_);
+                self->prepare_reject(std::move(caller->any_));
         } catch(...) {
             self->prepare_reject(std::current_exception());
         }
@@ -1597,7 +2609,7 @@ struct ResolveChecker {
         if (verify_func_arg(func, caller->any_))
             self->prepare_resolve(call_func(func, caller->any_));
         else
-            self->prepare_reject(caller->any_);
+            self->prepare_reject(std::move(caller->any_));
 #endif
         return self;
     }
@@ -1613,7 +2625,7 @@ struct ResolveChecker<Defer, FUNC> {
                 return ret;
             }
             else {
-                self->prepare_reject(caller->any_);
+                self->prepare_reject(std::move(caller->any_));
                 return self;
             }
         } catch(...) {
@@ -1626,7 +2638,7 @@ struct ResolveChecker<Defer, FUNC> {
             return ret;
         }
         else {
-            self->prepare_reject(caller->any_);
+            self->prepare_reject(std::move(caller->any_));
             return self;
         }
 #endif
@@ -1647,9 +2659,10 @@ struct ResolveChecker<Bypass, FUNC> {
         }
         return self;
 #else
-        pm_any any = caller->any_;
+        /* The function of finally() leaves the value in caller, which is
+           handed to self then */
         func(caller);
-        self->prepare_resolve(any);
+        self->prepare_resolve(std::move(caller->any_));
         return self;
 #endif
     }
@@ -1661,21 +2674,21 @@ struct ResolveChecker<RET, FnSimple> {
 #ifndef PM_EMBED
         try {
             if (func == nullptr)
-                self->prepare_resolve(caller->any_);
+                self->prepare_resolve(std::move(caller->any_));
             else if (verify_func_arg(func, caller->any_))
                 self->prepare_resolve(call_func(func, caller->any_));
             else
-                self->prepare_reject(caller->any_);
+                self->prepare_reject(std::move(caller->any_));
         } catch(...) {
             self->prepare_reject(std::current_exception());
         }
 #else
         if (func == nullptr)
-            self->prepare_resolve(caller->any_);
+            self->prepare_resolve(std::move(caller->any_));
         else if (verify_func_arg(func, caller->any_))
             self->prepare_resolve(call_func(func, caller->any_));
         else
-            self->prepare_reject(caller->any_);
+            self->prepare_reject(std::move(caller->any_));
 #endif
         return self;
     }
@@ -1726,13 +2739,13 @@ struct RejectChecker {
     static Defer call(const FUNC &func, Defer &self, Promise *caller) {
 #ifndef PM_EMBED
         try {
-            if(caller->any_.type() == typeid(std::exception_ptr)){
+            if(caller->any_.type() == pm_type_of<std::exception_ptr>()){
                 self->prepare_resolve(ExCheck<std::tuple_size<arg_type>::value, FUNC>::call(func, self, caller));
             }
             else if (verify_func_arg(func, caller->any_))
                 self->prepare_resolve(call_func(func, caller->any_));
             else
-                self->prepare_reject(caller->any_);
+                self->prepare_reject(std::move(caller->any_));
         } catch(...) {
             self->prepare_reject(std::current_exception());
         }
@@ -1740,7 +2753,7 @@ struct RejectChecker {
         if (verify_func_arg(func, caller->any_))
             self->prepare_resolve(call_func(func, caller->any_));
         else
-            self->prepare_reject(caller->any_);
+            self->prepare_reject(std::move(caller->any_));
 #endif
         return self;
     }
@@ -1752,7 +2765,7 @@ struct RejectChecker<Defer, FUNC> {
     static Defer call(const FUNC &func, Defer &self, Promise *caller) {
 #ifndef PM_EMBED
         try {
-            if(caller->any_.type() == typeid(std::exception_ptr)){
+            if(caller->any_.type() == pm_type_of<std::exception_ptr>()){
                 Defer ret = std::get<0>(ExCheck<std::tuple_size<arg_type>::value, FUNC>::call(func, self, caller));
                 return ret;
             }
@@ -1761,7 +2774,7 @@ struct RejectChecker<Defer, FUNC> {
                 return ret;
             }
             else {
-                self->prepare_reject(caller->any_);
+                self->prepare_reject(std::move(caller->any_));
                 return self;
             }
         }
@@ -1775,7 +2788,7 @@ struct RejectChecker<Defer, FUNC> {
             return ret;
         }
         else {
-            self->prepare_reject(caller->any_);
+            self->prepare_reject(std::move(caller->any_));
             return self;
         }
 #endif
@@ -1797,9 +2810,10 @@ struct RejectChecker<Bypass, FUNC> {
         }
         return self;
 #else
-        pm_any any = caller->any_;
+        /* The function of finally() leaves the value in caller, which is
+           handed to self then */
         func(self, caller);
-        self->prepare_reject(any);
+        self->prepare_reject(std::move(caller->any_));
         return self;
 #endif
     }
@@ -1811,21 +2825,21 @@ struct RejectChecker<RET, FnSimple> {
 #ifndef PM_EMBED
         try {
             if (func == nullptr)
-                self->prepare_reject(caller->any_);
+                self->prepare_reject(std::move(caller->any_));
             else if (verify_func_arg(func, caller->any_))
                 self->prepare_resolve(call_func(func, caller->any_));
             else
-                self->prepare_reject(caller->any_);
+                self->prepare_reject(std::move(caller->any_));
         } catch(...) {
             self->prepare_reject(std::current_exception());
         }
 #else
         if (func == nullptr)
-            self->prepare_reject(caller->any_);
+            self->prepare_reject(std::move(caller->any_));
         else if (verify_func_arg(func, caller->any_))
             self->prepare_resolve(call_func(func, caller->any_));
         else
-            self->prepare_reject(caller->any_);
+            self->prepare_reject(std::move(caller->any_));
 #endif
         return self;
     }
@@ -1843,6 +2857,19 @@ inline Defer newPromise(FUNC func) {
     return promise;
 }
 
+/* Create new promise object in priority class 0 ~ PM_PRIORITY_LEVELS-1,
+   promises created in func inherit the priority */
+template <typename FUNC>
+inline Defer newPromise(FUNC func, uint8_t priority) {
+    uint8_t &current = Promise::current_priority();
+    uint8_t parent = current;
+    current = (priority < PM_PRIORITY_LEVELS ? priority : PM_PRIORITY_LEVELS - 1);
+    Defer promise = newHeadPromise();
+    promise->run(func, promise);
+    current = parent;
+    return promise;
+}
+
 /*
  * While loop func call resolved, 
  * It is not safe since the promise chain will become longer infinitely 
@@ -1863,6 +2890,361 @@ inline Defer doWhile(FUNC func) {
     });
 }
 
+#ifndef PM_NO_VTABLE
+template <typename LOOP, bool REJECTED>
+struct LoopCaller
+    : public PromiseCaller{
+    virtual Defer call(Defer &self, Promise *caller) {
+        return static_cast<LOOP *>(self.operator->())->step(self, REJECTED, caller);
+    }
+};
+#endif
+
+/* Promise of doLoop(). The body of each iteration is linked before it and cut
+   off again when it is settled, so the bodies are reused instead of obtained */
+template <typename FUNC>
+struct LoopPromise : public Promise {
+    FUNC func_;
+    Defer spare_;       /* A body cut off before, reused when nothing holds it */
+    bool running_;      /* func_ is being called */
+    bool again_;        /* The body was resolved while func_ was called */
+#ifndef PM_NO_VTABLE
+    void *callers_buf_[2];
+#endif
+
+    LoopPromise(FUNC func)
+        : Promise()
+        , func_(std::move(func))
+        , spare_()
+        , running_(false)
+        , again_(false) {
+#ifdef PM_NO_VTABLE
+        invoke_ = &invoke;
+        destroy_ = &destroy;
+        callers_ = kResolvedCaller | kRejectedCaller;
+#else
+        inline_ = 1;
+        resolved_ = new(&callers_buf_[0]) LoopCaller<LoopPromise, false>();
+        rejected_ = new(&callers_buf_[1]) LoopCaller<LoopPromise, true>();
+#endif
+    }
+
+#ifdef PM_NO_VTABLE
+    static Defer invoke(Promise *promise, bool rejected, Defer &self, Promise *caller) {
+        return static_cast<LoopPromise *>(promise)->step(self, rejected, caller);
+    }
+
+    /* The destructor of LoopPromise is not called with PM_NO_VTABLE */
+    static void destroy(Promise *promise) {
+        LoopPromise *loop = static_cast<LoopPromise *>(promise);
+        loop->func_.~FUNC();
+        loop->spare_.clear();
+    }
+#endif
+
+    /* The body linked before this promise is settled */
+    Defer step(Defer &self, bool rejected, Promise *caller) {
+        Promise *body = static_cast<Promise *>(pm_stack::itr_to_ptr(prev_));
+        pm_allocator::add_ref(body);
+        Defer last(body);
+        /* self is next_ of the body and is emptied here, so the body neither
+           clears the functions of this promise nor runs what follows it */
+        Defer loop = splitDeferObject(body);
+        if (rejected) {
+            prepare_reject(std::move(caller->any_));
+            call_next();
+        }
+        else if (running_)
+            again_ = true;
+        else if (status_ == kInit)
+            run(loop, std::move(last));
+        return self;
+    }
+
+    /* Call func_ until the body is not resolved in place */
+    void run(Defer &loop, Defer body) {
+        running_ = true;
+        do {
+            again_ = false;
+            /* Reuse the last body if nothing else holds it, or else the spare one */
+            if (body.operator->() == nullptr || pm_allocator::ref_count(body.operator->()) != 1) {
+                Defer spare(std::move(spare_));
+                if (body.operator->() != nullptr)
+                    spare_ = std::move(body);
+                if (spare.operator->() != nullptr && pm_allocator::ref_count(spare.operator->()) == 1)
+                    body = std::move(spare);
+                else
+                    body = newHeadPromise();
+            }
+            body->status_ = kInit;
+            body->priority_ = priority_;
+            joinDeferObject(body.operator->(), loop);
+            func_(body);
+        } while (again_ && status_ == kInit);
+        running_ = false;
+    }
+};
+
+/* While loop func call resolved, as doWhile(), but the promise passed to func
+   is reused by later iterations, so it must not be used after it is settled */
+template <typename FUNC>
+inline Defer doLoop(FUNC func) {
+    LoopPromise<FUNC> *promise = pm_new<LoopPromise<FUNC>>(std::move(func));
+    Defer loop(promise);
+    promise->run(loop, Defer());
+    return loop;
+}
+
+/* Functions of a TypedPromise<T...>, its address tells the types.
+   The tables are const, in flash */
+struct typed_ops {
+    void (*box)(Promise *promise);
+    void (*destroy)(Promise *promise);
+};
+
+struct TypedPromiseBase : public Promise {
+    const typed_ops *ops_;
+
+    TypedPromiseBase(const typed_ops *ops)
+        : Promise()
+        , ops_(ops) {
+        typed_ = 1;
+    }
+};
+
+/* Promise which keeps its resolved values in place of any_ */
+template <typename ...T>
+struct TypedPromise : public TypedPromiseBase {
+    typedef std::tuple<T...> value_type;
+    static_assert(std::is_same<value_type, typename remove_reference_tuple<value_type>::type>::value,
+        "TypedPromise takes the types of the values, not references or const types");
+
+    static const typed_ops ops;
+    alignas(value_type) unsigned char value_[sizeof(value_type)];
+
+    TypedPromise()
+        : TypedPromiseBase(&ops) {
+    }
+
+    /* ~Promise() destroys the values with PM_NO_VTABLE */
+    ~TypedPromise() {
+        if (in_place_)
+            typed_clear(this);
+    }
+
+    value_type &value() {
+        return *reinterpret_cast<value_type *>(value_);
+    }
+
+    template <typename ...ARG>
+    void prepare_resolve_typed(ARG &&...arg) {
+        if (status_ != kInit) return;
+        new(value_) value_type(std::forward<ARG>(arg)...);
+        status_ = kResolved;
+        in_place_ = 1;
+    }
+
+    /* Put the values into any_, as resolve() of an untyped promise does */
+    static void box(Promise *promise) {
+        promise->any_ = std::move(static_cast<TypedPromise *>(promise)->value());
+    }
+
+    static void destroy(Promise *promise) {
+        static_cast<TypedPromise *>(promise)->value().~value_type();
+    }
+};
+
+template <typename ...T>
+const typed_ops TypedPromise<T...>::ops = { &TypedPromise<T...>::box, &TypedPromise<T...>::destroy };
+
+inline void typed_box(Promise *promise) {
+    static_cast<TypedPromiseBase *>(promise)->ops_->box(promise);
+}
+
+inline void typed_clear(Promise *promise) {
+    promise->in_place_ = 0;
+    static_cast<TypedPromiseBase *>(promise)->ops_->destroy(promise);
+}
+
+template <typename ...T>
+class TypedDefer;
+
+/* The arguments of a function are the values of a TypedDefer, or the first ones of them */
+template <typename ARGS, typename VALUES>
+struct typed_args_match : public std::false_type {};
+
+template <typename ...VALUES>
+struct typed_args_match<std::tuple<>, std::tuple<VALUES...>> : public std::true_type {};
+
+template <typename ARG, typename ...ARGS, typename VALUE, typename ...VALUES>
+struct typed_args_match<std::tuple<ARG, ARGS...>, std::tuple<VALUE, VALUES...>>
+    : public std::integral_constant<bool, std::is_same<ARG, VALUE>::value
+        && typed_args_match<std::tuple<ARGS...>, std::tuple<VALUES...>>::value> {};
+
+/* The promise made by then() of a TypedDefer for what its function returns.
+   call() passes the values in place, store() takes what call_func() returned */
+template <typename RET>
+struct typed_result {
+    typedef TypedPromise<RET> node_type;
+    typedef TypedDefer<RET> defer_type;
+
+    template <typename FUNC, typename TUPLE, std::size_t ...I>
+    static Defer call(const FUNC &func, Defer &self, TUPLE &arg, const std::index_sequence<I...> &) {
+        static_cast<node_type *>(self.operator->())->prepare_resolve_typed(func(func_arg_pass<true, I, FUNC>::get(std::get<I>(arg))...));
+        return self;
+    }
+
+    static Defer store(Defer &self, std::tuple<RET> &&ret) {
+        static_cast<node_type *>(self.operator->())->prepare_resolve_typed(std::move(std::get<0>(ret)));
+        return self;
+    }
+};
+
+template <>
+struct typed_result<void> {
+    typedef TypedPromise<> node_type;
+    typedef TypedDefer<> defer_type;
+
+    template <typename FUNC, typename TUPLE, std::size_t ...I>
+    static Defer call(const FUNC &func, Defer &self, TUPLE &arg, const std::index_sequence<I...> &) {
+        func(func_arg_pass<true, I, FUNC>::get(std::get<I>(arg))...);
+        static_cast<node_type *>(self.operator->())->prepare_resolve_typed();
+        return self;
+    }
+
+    static Defer store(Defer &self, std::tuple<> &&) {
+        static_cast<node_type *>(self.operator->())->prepare_resolve_typed();
+        return self;
+    }
+};
+
+template <>
+struct typed_result<Defer> {
+    typedef Promise node_type;
+    typedef Defer defer_type;
+
+    template <typename FUNC, typename TUPLE, std::size_t ...I>
+    static Defer call(const FUNC &func, Defer &, TUPLE &arg, const std::index_sequence<I...> &) {
+        return func(func_arg_pass<true, I, FUNC>::get(std::get<I>(arg))...);
+    }
+
+    static Defer store(Defer &, std::tuple<Defer> &&ret) {
+        return std::move(std::get<0>(ret));
+    }
+};
+
+template <typename ...U>
+struct typed_result<TypedDefer<U...>> {
+    typedef Promise node_type;
+    typedef TypedDefer<U...> defer_type;
+
+    template <typename FUNC, typename TUPLE, std::size_t ...I>
+    static Defer call(const FUNC &func, Defer &, TUPLE &arg, const std::index_sequence<I...> &) {
+        return func(func_arg_pass<true, I, FUNC>::get(std::get<I>(arg))...);
+    }
+
+    static Defer store(Defer &, std::tuple<TypedDefer<U...>> &&ret) {
+        return std::move(std::get<0>(ret));
+    }
+};
+
+/* Resolved caller of then() of a TypedDefer<T...> */
+template <typename FUNC_ON_RESOLVED, typename ...T>
+struct TypedResolvedCaller
+    : public PromiseCaller{
+    typedef typename tuple_remove_reference<typename func_traits<FUNC_ON_RESOLVED>::ret_type>::type resolve_ret_type;
+    typedef typename func_traits<FUNC_ON_RESOLVED>::arg_type arg_type;
+    typedef typed_result<resolve_ret_type> result;
+    static const bool reads_in_place = true;
+    FUNC_ON_RESOLVED on_resolved_;
+
+    TypedResolvedCaller(FUNC_ON_RESOLVED on_resolved)
+        : on_resolved_(std::move(on_resolved)){}
+
+    PM_VIRTUAL Defer call(Defer &self, Promise *caller) {
+#ifndef PM_EMBED
+        try {
+            return call_typed(self, caller);
+        } catch(...) {
+            self->prepare_reject(std::current_exception());
+            return self;
+        }
+#else
+        return call_typed(self, caller);
+#endif
+    }
+
+    Defer call_typed(Defer &self, Promise *caller) {
+        if (caller->in_place_ && static_cast<TypedPromiseBase *>(caller)->ops_ == &TypedPromise<T...>::ops) {
+            return result::call(on_resolved_, self, static_cast<TypedPromise<T...> *>(caller)->value(),
+                std::make_index_sequence<std::tuple_size<arg_type>::value>());
+        }
+        /* Not a TypedPromise<T...>, e.g. an untyped Defer was returned in between */
+        if (caller->in_place_)
+            typed_box(caller);
+        if (verify_func_arg(on_resolved_, caller->any_))
+            return result::store(self, call_func(on_resolved_, caller->any_));
+        self->prepare_reject(std::move(caller->any_));
+        return self;
+    }
+};
+
+/* Promise resolved with values of the types T..., then() passes them to its
+   function in place, and checks the arguments of the function when it is
+   compiled. Everything else of Defer works on it with the values in any_ */
+template <typename ...T>
+class TypedDefer : public Defer {
+public:
+    /* The name in pm_shared_ptr_promise is private */
+    typedef pm_shared_ptr_promise<Promise> Defer;
+
+    TypedDefer()
+        : Defer() {
+    }
+
+    /* The values of a promise which is not a TypedPromise<T...> are read from
+       any_ and checked when they are passed, as for an untyped Defer */
+    explicit TypedDefer(const Defer &promise)
+        : Defer(promise) {
+    }
+
+    explicit TypedDefer(Defer &&promise)
+        : Defer(std::move(promise)) {
+    }
+
+    /* The values are taken by value and moved on, so temporaries are not copied */
+    void resolve(T ...value) const {
+        Promise *promise = operator->();
+        if (promise->typed_ && static_cast<TypedPromiseBase *>(promise)->ops_ == &TypedPromise<T...>::ops) {
+            static_cast<TypedPromise<T...> *>(promise)->prepare_resolve_typed(std::move(value)...);
+            if (promise->status_ == Promise::kResolved)
+                promise->call_next();
+        }
+        else
+            promise->resolve(std::move(value)...);
+    }
+
+    using Defer::then;
+
+    template <typename FUNC_ON_RESOLVED>
+    typename TypedResolvedCaller<FUNC_ON_RESOLVED, T...>::result::defer_type
+    then(FUNC_ON_RESOLVED on_resolved) const {
+        typedef TypedResolvedCaller<FUNC_ON_RESOLVED, T...> caller_type;
+        static_assert(typed_args_match<typename caller_type::arg_type, std::tuple<T...>>::value,
+            "The function of then() must take the types of the values, or of the first ones");
+        return typename caller_type::result::defer_type(operator->()->template
+            then_callers<caller_type, void, typename caller_type::result::node_type>(std::move(on_resolved), nullptr));
+    }
+};
+
+/* Create new promise object resolved with values of the types T... */
+template <typename ...T, typename FUNC>
+inline TypedDefer<T...> newTypedPromise(FUNC func) {
+    TypedDefer<T...> promise(Defer(pm_new<TypedPromise<T...>>()));
+    func(promise);
+    return promise;
+}
+
 /* Return a rejected promise directly */
 template <typename ...RET_ARG>
 inline Defer reject(const RET_ARG &... ret_arg){
@@ -1886,7 +3268,92 @@ namespace promise{
 inline void pm_run(){
     pm_timer::run();
     irq_x::run();
+#if PM_PRIORITY_LEVELS > 1
+    /* Poll irq after each promise, so that a higher priority promise woken
+       meanwhile does not wait for the rest of the lower priority ones */
+    while(defer_list::run_one())
+        irq_x::run();
+#else
     defer_list::run();
+#endif
+}
+
+/* Run the timers, irqs and a snapshot of the ready promises, promises made
+   ready meanwhile (e.g. by yield() or doWhile loops) wait for the next call.
+   With PM_PRIORITY_LEVELS > 1 irqs are polled after each promise as in
+   pm_run(), and a promise they wake of a higher priority than the one just
+   run joins the snapshot.
+   Stops after max_callbacks promises or max_ticks ticks, 0 for no limit.
+   Returns the number of ready promises left. A promise it runs may call
+   pm_run(), but not pm_run_for().
+ */
+inline uint32_t pm_run_for(uint32_t max_callbacks, uint32_t max_ticks = 0){
+    pm_run_stats *stats = defer_list::get_stats();
+    uint32_t start = pm_timer::get_ticks();
+    uint32_t callbacks = 0;
+
+    pm_timer::run();
+    irq_x::run();
+    defer_list::snapshot();
+    while(defer_list::run_snapshot_one()){
+        ++callbacks;
+#if PM_PRIORITY_LEVELS > 1
+        irq_x::run();
+#endif
+        if(max_callbacks != 0 && callbacks >= max_callbacks)
+            break;
+        if(max_ticks != 0 && pm_timer::get_ticks() - start >= max_ticks)
+            break;
+    }
+    uint32_t left = defer_list::drop_snapshot();
+    uint32_t ticks = pm_timer::get_ticks() - start;
+
+    ++stats->runs_;
+    stats->callbacks_ += callbacks;
+    if(left > 0)
+        ++stats->overruns_;
+    stats->last_depth_ = callbacks + left;
+    if(stats->last_depth_ > stats->max_depth_)
+        stats->max_depth_ = stats->last_depth_;
+    if(ticks > stats->max_ticks_)
+        stats->max_ticks_ = ticks;
+
+    return (defer_list::empty() ? 0 : defer_list::size());
+}
+
+/* Create the lists of the runtime and take no more memory from the arena,
+   pm_throw("frozen") is called on any later arena allocation. Call it at
+   the end of init, after pm_allocator::reserve() and irq<IRQ>::init().
+ */
+inline void pm_freeze(){
+    pm_memory_pool::get_pools();
+#ifdef PM_SLAB_PAGE
+    pm_slab_page::get_free_pages();
+    pm_slab_page::get_stats();
+#endif
+    pm_timer::get_global();
+    defer_list::init();
+    irq_x::init();
+    pm_stack::frozen() = true;
+}
+
+/* Tickless idle, call it after pm_run() instead of __WFE().
+   The periodic tick of CLOCK is stopped until the next timer expires,
+   wait() is called with interrupts disabled and must return on any
+   pending interrupt, e.g. __WFI().
+ */
+template <typename CLOCK, typename FUNC>
+inline void pm_idle(FUNC wait){
+    irq_disable();
+    if(defer_list::empty() && !irq_x::pending()){
+        uint32_t ticks = pm_timer::next_timeout();
+        if(ticks > 0){
+            CLOCK::suspend(ticks);
+            wait();
+            pm_timer::add_ticks(CLOCK::resume());
+        }
+    }
+    irq_enable();
 }
 
 }
@@ -30,7 +30,45 @@
  */
 
 //#define PM_DEBUG
+#ifndef PM_EMBED_STACK
 #define PM_EMBED_STACK 2048
+#endif
+
+/* Number of priority classes of the ready list, 0 is the lowest */
+#ifndef PM_PRIORITY_LEVELS
+#define PM_PRIORITY_LEVELS 1
+#endif
+
+/* Size classes of the memory pools, objects of near sizes share one pool.
+   PM_SIZE_CLASS_STEPS is the number of classes between two powers of two --
+   0: one class for each pointer-rounded size, 1: powers of two,
+   4: classes at most 1.25x apart. Sizes above PM_SIZE_CLASS_MAX keep their own class. */
+#ifndef PM_SIZE_CLASS_STEPS
+#define PM_SIZE_CLASS_STEPS 0
+#endif
+#ifndef PM_SIZE_CLASS_MAX
+#define PM_SIZE_CLASS_MAX 256
+#endif
+
+/* Carve the pool blocks from pages of PM_SLAB_PAGE bytes, a power of 2.
+   Pages without live blocks go to the pools that need one, of any size class. */
+//#define PM_SLAB_PAGE 256
+
+/* The callers of then() are put in the block of the new promise, one
+   allocation for each then(), if they take at most PM_INLINE_CALLER bytes.
+   Larger ones are obtained apart. 0 obtains them apart always. */
+#ifndef PM_INLINE_CALLER
+#define PM_INLINE_CALLER (4 * sizeof(void *))
+#endif
+
+/* Promise and the callers of then() have no vtable, the callers are called
+   and destroyed through a pair of function pointers in the promise. */
+//#define PM_NO_VTABLE
+
+/* Pointers to objects in the arena -- Defer, the callers of then() --
+   are kept as pm_stack::itr_t offsets, which are 16 bits if the arena has at
+   most 65536 pointer sized words. */
+//#define PM_COMPACT_PTR
 
 #include <memory>
 #include <typeinfo>
@@ -73,6 +111,23 @@ inline constexpr size_t pm_log(size_t n) {
     return (n <= 1 ? 0 : 1 + pm_log(n >> 1));
 }
 
+inline constexpr size_t pm_round_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+/* Distance between the classes from the power of two below size */
+inline constexpr size_t pm_size_class_step(size_t size, size_t steps) {
+    return ((size_t)1 << pm_log(size)) / steps < sizeof(void *)
+        ? sizeof(void *) : ((size_t)1 << pm_log(size)) / steps;
+}
+
+/* Pool size of an object of size bytes */
+inline constexpr size_t pm_size_class(size_t size) {
+    return (PM_SIZE_CLASS_STEPS == 0 || size > PM_SIZE_CLASS_MAX)
+        ? pm_round_up(size, sizeof(void *))
+        : pm_round_up(size, pm_size_class_step(size, PM_SIZE_CLASS_STEPS));
+}
+
 template<bool match_uint8, bool match_uint16, bool match_uint32>
 struct pm_offset_impl {
     typedef uint64_t type;
@@ -109,21 +164,63 @@ struct pm_stack {
     }
 
     static void *allocate(size_t size) {
-        static char *top = start();
+        char *&top = get_top();
         char *start_ = start();
 
         size = (size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
-        if (start_ + PM_EMBED_STACK < top + size)
+        if (get_bottom() < top + size)
             pm_throw("no_mem");
+        if (frozen())
+            pm_throw("frozen");
 
         void *ret = top;
         top += size;
 
-        g_stack_size = (uint32_t)(top - start_);
+        g_stack_size = (uint32_t)(top - start_ + (start_ + PM_EMBED_STACK - get_bottom()));
         //printf("mem ======= %d %d, size = %d, %d, %d, %x\n", (int)(top - start_), (int)sizeof(void *), (int)size, OFFSET_IGNORE_BIT, (int)sizeof(itr_t), ret);
         return ret;
     }
 
+#ifdef PM_SLAB_PAGE
+    /* Pages are taken from the end of the arena, aligned to PM_SLAB_PAGE from
+       start(), so the page of a block is found from its address */
+    static void *allocate_page() {
+        static_assert((PM_SLAB_PAGE & (PM_SLAB_PAGE - 1)) == 0, "PM_SLAB_PAGE must be a power of 2");
+        char *&bottom = get_bottom();
+        char *start_ = start();
+
+        size_t offset = (size_t)(bottom - start_);
+        if (offset < PM_SLAB_PAGE)
+            pm_throw("no_mem");
+        char *page = start_ + ((offset - PM_SLAB_PAGE) & ~((size_t)PM_SLAB_PAGE - 1));
+        if (page < get_top())
+            pm_throw("no_mem");
+        if (frozen())
+            pm_throw("frozen");
+        bottom = page;
+
+        g_stack_size = (uint32_t)(get_top() - start_ + (start_ + PM_EMBED_STACK - bottom));
+        return page;
+    }
+#endif
+
+    /* The arena is used from start() up to get_top(), and from get_bottom() to the end */
+    static char *&get_top() {
+        static char *top = start();
+        return top;
+    }
+
+    static char *&get_bottom() {
+        static char *bottom = start() + PM_EMBED_STACK;
+        return bottom;
+    }
+
+    /* Set by pm_freeze(), no more memory is taken from the arena */
+    static bool &frozen() {
+        static bool frozen_ = false;
+        return frozen_;
+    }
+
     static const size_t OFFSET_IGNORE_BIT = pm_log(sizeof(void *));
     typedef pm_offset<PM_EMBED_STACK, sizeof(void *)>::type itr_t;
     //static const size_t OFFSET_IGNORE_BIT = 0;
@@ -151,13 +248,68 @@ struct pm_stack {
 #endif
 };
 
+/* Pointer to an object in the arena, STORAGE is T * or pm_stack::itr_t */
+template <typename T, typename STORAGE>
+class pm_ptr {
+public:
+    pm_ptr(T *ptr = nullptr)
+        : itr_(pm_stack::ptr_to_itr(static_cast<void *>(ptr))) {
+    }
+
+    inline T *get() const {
+        return static_cast<T *>(pm_stack::itr_to_ptr(itr_));
+    }
+
+    inline T *operator->() const {
+        return get();
+    }
+
+    inline operator T *() const {
+        return get();
+    }
+
+private:
+    STORAGE itr_;
+};
+
+template <typename T>
+class pm_ptr<T, T *> {
+public:
+    pm_ptr(T *ptr = nullptr)
+        : ptr_(ptr) {
+    }
+
+    inline T *get() const {
+        return ptr_;
+    }
+
+    inline T *operator->() const {
+        return ptr_;
+    }
+
+    inline operator T *() const {
+        return ptr_;
+    }
+
+private:
+    T *ptr_;
+};
+
+#ifdef PM_COMPACT_PTR
+template <typename T>
+using pm_arena_ptr = pm_ptr<T, pm_stack::itr_t>;
+#else
+template <typename T>
+using pm_arena_ptr = pm_ptr<T, T *>;
+#endif
+
 template< class T, class... Args >
 inline T *pm_stack_new(Args&&... args) {
     return new
 #ifdef PM_EMBED_STACK
         (pm_stack::allocate(sizeof(T)))
 #endif
-        T(args...);
+        T(std::forward<Args>(args)...);
 }
 
 
@@ -246,13 +398,131 @@ private:
 };
 
 
+#ifdef PM_SLAB_PAGE
+/* Statistics of the pages */
+struct pm_slab_stats{
+    uint32_t pages_;        /* Pages taken from the arena */
+    uint32_t free_;         /* Pages in pm_slab_page::get_free_pages() */
+    uint32_t empty_;        /* Pages of pools without live blocks, they can be reclaimed */
+    uint32_t reclaims_;     /* Pages reused from pm_slab_page::get_free_pages() */
+    pm_slab_stats()
+        : pages_(0)
+        , free_(0)
+        , empty_(0)
+        , reclaims_(0){
+    }
+};
+
+/* A page of pool blocks, linked in the pages_ of its pool,
+   or in get_free_pages() after it's reclaimed */
+struct pm_slab_page {
+    alignas(void *) pm_list list_;
+    pm_stack::itr_t live_;          /* Blocks in use */
+    pm_slab_page()
+        : list_()
+        , live_(0){
+    }
+
+    static inline pm_slab_page *from_list(pm_list *node){
+        return pm_container_of(node, &pm_slab_page::list_);
+    }
+
+    /* The page of a block */
+    static inline pm_slab_page *from_ptr(void *ptr){
+        size_t offset = (size_t)(reinterpret_cast<char *>(ptr) - pm_stack::start());
+        return reinterpret_cast<pm_slab_page *>(pm_stack::start() + (offset & ~((size_t)PM_SLAB_PAGE - 1)));
+    }
+
+    /* Offset of the first block */
+    static inline size_t data_offset(){
+        return pm_round_up(sizeof(pm_slab_page), sizeof(void *));
+    }
+
+    /* Blocks of buf_size bytes in a page, 0 if a block is larger than a page */
+    static inline size_t capacity(size_t buf_size){
+        return (PM_SLAB_PAGE - data_offset()) / buf_size;
+    }
+
+    inline void *block(size_t index, size_t buf_size){
+        return reinterpret_cast<char *>(this) + data_offset() + index * buf_size;
+    }
+
+    static pm_list *get_free_pages(){
+        static pm_list *pages = nullptr;
+        if(pages == nullptr)
+            pages = pm_stack_new<pm_list>();
+        return pages;
+    }
+
+    static pm_slab_stats *get_stats(){
+        static pm_slab_stats *stats = nullptr;
+        if(stats == nullptr)
+            stats = pm_stack_new<pm_slab_stats>();
+        return stats;
+    }
+};
+#endif
+
+/* One pool for each size class, all pools are linked in get_pools() for statistics.
+   A pool can not have more blocks than the arena, so pm_stack::itr_t holds the counts. */
 struct pm_memory_pool {
     pm_list free_;
+    alignas(void *) pm_list list_;  /* Link in get_pools() */
+#ifdef PM_SLAB_PAGE
+    alignas(void *) pm_list pages_; /* Pages of the blocks */
+    pm_stack::itr_t page_blocks_;   /* Blocks in each page, 0 if blocks are larger than pages */
+    pm_stack::itr_t reserved_;      /* Blocks kept by pm_allocator::reserve(), not reclaimed */
+#endif
     size_t size_;
-    pm_memory_pool(size_t size)
+    size_t buf_size_;               /* Arena bytes of each block, header included */
+    pm_stack::itr_t blocks_;        /* Blocks taken from the arena */
+    pm_stack::itr_t live_;          /* Blocks in use */
+    pm_stack::itr_t peak_;          /* Maximum of live_ */
+    pm_memory_pool(size_t size, size_t buf_size)
         : free_()
-        , size_(size){
+        , list_()
+#ifdef PM_SLAB_PAGE
+        , pages_()
+        , page_blocks_((pm_stack::itr_t)pm_slab_page::capacity(buf_size))
+        , reserved_(0)
+#endif
+        , size_(size)
+        , buf_size_(buf_size)
+        , blocks_(0)
+        , live_(0)
+        , peak_(0){
+        get_pools()->attach(&list_);
+    }
+
+    static pm_list *get_pools(){
+        static pm_list *pools = nullptr;
+        if(pools == nullptr)
+            pools = pm_stack_new<pm_list>();
+        return pools;
+    }
+
+    static inline pm_memory_pool *from_list(pm_list *node){
+        return pm_container_of(node, &pm_memory_pool::list_);
+    }
+
+    size_t free_count() const {
+        return (size_t)blocks_ - live_;
+    }
+
+#ifdef PM_SLAB_PAGE
+    size_t page_count() const {
+        return (page_blocks_ == 0 ? 0 : (size_t)blocks_ / page_blocks_);
     }
+
+    size_t arena_bytes() const {
+        return sizeof(pm_memory_pool) + (page_blocks_ == 0
+            ? (size_t)blocks_ * buf_size_ : page_count() * PM_SLAB_PAGE);
+    }
+#else
+    size_t arena_bytes() const {
+        return sizeof(pm_memory_pool) + (size_t)blocks_ * buf_size_;
+    }
+#endif
 };
 
 //allocator
@@ -315,7 +585,7 @@ struct pm_size_allocator {
     static pm_memory_pool *get_memory_pool() {
         static pm_memory_pool *pool_ = nullptr;
         if(pool_ == nullptr)
-            pool_ = pm_stack_new<pm_memory_pool>(SIZE);
+            pool_ = pm_stack_new<pm_memory_pool>(SIZE, sizeof(pm_memory_pool_buf<SIZE>));
         return pool_;
     }
 };
@@ -332,8 +602,22 @@ private:
     template <size_t SIZE>
     static void *obtain_impl() {
         g_alloc_size += SIZE;
+        ++obtain_count();
         pm_memory_pool *pool = pm_size_allocator<SIZE>::get_memory_pool();
+        if (++pool->live_ > pool->peak_)
+            pool->peak_ = pool->live_;
+#ifdef PM_SLAB_PAGE
+        if (pool->page_blocks_ != 0) {
+            if (pool->free_.empty())
+                add_page(pool);
+            pm_memory_pool_buf_header *header = obtain_pool_buf(pool);
+            if (pm_slab_page::from_ptr(header)->live_++ == 0)
+                --pm_slab_page::get_stats()->empty_;
+            return pm_memory_pool_buf_header::to_ptr(header);
+        }
+#endif
         if (pool->free_.empty()) {
+            ++pool->blocks_;
             pm_memory_pool_buf<SIZE> *pool_buf = 
                 pm_stack_new<pm_memory_pool_buf<SIZE>>(pool);
             //printf("++++ obtain = %p %d\n", (void *)&pool_buf->buf_, sizeof(T));
@@ -348,11 +632,80 @@ private:
         }
     }
 
+#ifdef PM_SLAB_PAGE
+    /* Carve the blocks of a page to the free list of pool */
+    static void add_page(pm_memory_pool *pool) {
+        pm_slab_page *page = obtain_page();
+        ++pm_slab_page::get_stats()->empty_;
+
+        pool->pages_.attach(&page->list_);
+        for (size_t i = 0; i < pool->page_blocks_; ++i) {
+            pm_memory_pool_buf_header *header = new(page->block(i, pool->buf_size_))
+                pm_memory_pool_buf_header(pool);
+            pool->free_.attach(&header->list_);
+        }
+        pool->blocks_ += pool->page_blocks_;
+    }
+
+    /* A reclaimed page if there's one, or a new page from the arena */
+    static pm_slab_page *obtain_page() {
+        pm_slab_stats *stats = pm_slab_page::get_stats();
+        pm_list *free_pages = pm_slab_page::get_free_pages();
+        if (free_pages->empty() && stats->empty_ > 0)
+            reclaim();
+
+        if (!free_pages->empty()) {
+            pm_list *node = free_pages->next();
+            node->detach();
+            --stats->free_;
+            ++stats->reclaims_;
+            return pm_slab_page::from_list(node);
+        }
+
+        ++stats->pages_;
+        return new(pm_stack::allocate_page()) pm_slab_page();
+    }
+#endif
+
+    template <typename WRITE>
+    static void write_line(WRITE &write,
+        const char *name0, size_t value0, const char *name1, size_t value1,
+        const char *name2, size_t value2, const char *name3, size_t value3,
+        const char *name4 = nullptr, size_t value4 = 0) {
+        const char *names[] = { name0, name1, name2, name3, name4 };
+        size_t values[] = { value0, value1, value2, value3, value4 };
+        for(size_t i = 0; i < 5 && names[i] != nullptr; ++i){
+            char buf[24];
+            char *str = buf + sizeof(buf) - 1;
+            *str = '\0';
+            size_t value = values[i];
+            do{
+                *--str = (char)('0' + value % 10);
+                value /= 10;
+            }while(value != 0);
+            write(names[i]);
+            write(str);
+        }
+        write("\n");
+    }
+
     static void release(void *ptr) {
         //printf("--- release = %p\n", ptr);
         pm_memory_pool_buf_header *header = pm_memory_pool_buf_header::from_ptr(ptr);
         pm_memory_pool *pool = reinterpret_cast<pm_memory_pool *>(pm_stack::itr_to_ptr(header->pool_));
+#ifdef PM_SLAB_PAGE
+        if (pool->page_blocks_ != 0) {
+            /* The last released block is obtained first, so that the other pages get empty */
+            pool->free_.next()->move(&header->list_);
+            if (--pm_slab_page::from_ptr(header)->live_ == 0)
+                ++pm_slab_page::get_stats()->empty_;
+        }
+        else
+            pool->free_.move(&header->list_);
+#else
         pool->free_.move(&header->list_);
+#endif
+        --pool->live_;
         g_alloc_size -= pool->size_;
     }
 
@@ -362,6 +715,7 @@ private:
             pm_memory_pool_buf_header *header = pm_memory_pool_buf_header::from_ptr(object);
             //printf("++ %p %d -> %d\n", pool_buf, pool_buf->ref_count_, pool_buf->ref_count_ + 1);
             ++header->ref_count_;
+            ++ref_count_ops();
         }
     }
 
@@ -372,6 +726,7 @@ private:
             //printf("-- %p %d -> %d\n", pool_buf, pool_buf->ref_count_, pool_buf->ref_count_ - 1);
             pm_assert(header->ref_count_ > 0);
             --header->ref_count_;
+            ++ref_count_ops();
             if (header->ref_count_ == 0) {
                 pm_allocator::release(object);
                 return true;
@@ -380,10 +735,133 @@ private:
         return false;
     }
 
+    template <size_t SIZE>
+    static void reserve_impl(size_t count) {
+        pm_memory_pool *pool = pm_size_allocator<SIZE>::get_memory_pool();
+#ifdef PM_SLAB_PAGE
+        if (pool->reserved_ < pool->live_ + count)
+            pool->reserved_ = (pm_stack::itr_t)(pool->live_ + count);
+#endif
+        while (pool->free_count() < count) {
+#ifdef PM_SLAB_PAGE
+            if (pool->page_blocks_ != 0) {
+                add_page(pool);
+                continue;
+            }
+#endif
+            pm_memory_pool_buf<SIZE> *pool_buf =
+                pm_stack_new<pm_memory_pool_buf<SIZE>>(pool);
+            pool->free_.move(&pool_buf->header_.list_);
+            ++pool->blocks_;
+        }
+    }
+
 public:
+    /* Make sure the pool of T has count free blocks, so that obtaining
+       them later takes nothing from the arena. Call it at init. */
+    template <typename T>
+    static void reserve(size_t count) {
+        reserve_impl<pm_size_class(sizeof(T))>(count);
+    }
+
+    /* Same as reserve() for objects of SIZE bytes, e.g. the sizes
+       printed by dump(), when the type is a lambda's caller */
+    template <size_t SIZE>
+    static void reserve_size(size_t count) {
+        reserve_impl<pm_size_class(SIZE)>(count);
+    }
+
+    /* Blocks obtained since start, for benchmarks */
+    static uint32_t &obtain_count() {
+        static uint32_t count = 0;
+        return count;
+    }
+
+    /* Reference count increments and decrements since start, for benchmarks */
+    static uint32_t &ref_count_ops() {
+        static uint32_t count = 0;
+        return count;
+    }
+
+#ifdef PM_SLAB_PAGE
+    /* Move the pages without live blocks from their pools to
+       pm_slab_page::get_free_pages(), return the number of pages moved.
+       It's called when a pool needs a page, or call it after a busy phase. */
+    static uint32_t reclaim() {
+        pm_slab_stats *stats = pm_slab_page::get_stats();
+        pm_list *free_pages = pm_slab_page::get_free_pages();
+        pm_list *pools = pm_memory_pool::get_pools();
+        uint32_t count = 0;
+        for (pm_list *node = pools->next(); node != pools && stats->empty_ > 0; node = node->next()) {
+            pm_memory_pool *pool = pm_memory_pool::from_list(node);
+            for (pm_list *page_node = pool->pages_.next(); page_node != &pool->pages_; ) {
+                pm_slab_page *page = pm_slab_page::from_list(page_node);
+                page_node = page_node->next();
+                if (page->live_ != 0 || pool->blocks_ < pool->reserved_ + pool->page_blocks_) continue;
+
+                for (size_t i = 0; i < pool->page_blocks_; ++i) {
+                    pm_memory_pool_buf_header *header = reinterpret_cast<pm_memory_pool_buf_header *>(
+                        page->block(i, pool->buf_size_));
+                    header->list_.detach();
+                }
+                pool->blocks_ -= pool->page_blocks_;
+                page->list_.detach();
+                free_pages->attach(&page->list_);
+                --stats->empty_;
+                ++stats->free_;
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    /* Bytes of the pages kept by the pools and not used by live blocks */
+    static size_t unused_bytes() {
+        size_t bytes = 0;
+        for_each_pool([&bytes](const pm_memory_pool &pool){
+            if (pool.page_blocks_ != 0)
+                bytes += pool.page_count() * PM_SLAB_PAGE - (size_t)pool.live_ * pool.buf_size_;
+        });
+        return bytes;
+    }
+#endif
+
+    /* Call func(const pm_memory_pool &) for each pool */
+    template <typename FUNC>
+    static void for_each_pool(FUNC func) {
+        pm_list *pools = pm_memory_pool::get_pools();
+        for(pm_list *node = pools->next(); node != pools; node = node->next())
+            func(*pm_memory_pool::from_list(node));
+    }
+
+    /* Print the statistics of each pool and the arena by write(const char *),
+       one line each, without stdio */
+    template <typename WRITE>
+    static void dump(WRITE write) {
+        for_each_pool([&write](const pm_memory_pool &pool){
+            write_line(write, "pool size ", pool.size_, " live ", pool.live_,
+                " free ", pool.free_count(), " peak ", pool.peak_,
+                " arena ", pool.arena_bytes());
+        });
+#ifdef PM_SLAB_PAGE
+        pm_slab_stats *stats = pm_slab_page::get_stats();
+        write_line(write, "pages ", stats->pages_, " free ", stats->free_,
+            " empty ", stats->empty_, " reclaims ", stats->reclaims_,
+            " unused ", unused_bytes());
+#endif
+        write_line(write, "arena used ", g_stack_size, " of ", PM_EMBED_STACK,
+            " alloc ", g_alloc_size, " obtains ", obtain_count());
+    }
+
     template <typename T>
     static inline void *obtain() {
-        return obtain_impl<sizeof(T)>();
+        return obtain_impl<pm_size_class(sizeof(T))>();
+    }
+
+    /* References held to an object obtained by pm_new() */
+    template<typename T>
+    static inline int16_t ref_count(T *object) {
+        return pm_memory_pool_buf_header::from_ptr(reinterpret_cast<void *>(const_cast<T *>(object)))->ref_count_;
     }
 
     template<typename T>
@@ -402,7 +880,7 @@ public:
 
 template< class T, class... Args >
 inline T *pm_new(Args&&... args) {
-    T *object = new(pm_allocator::template obtain<T>()) T{args...};
+    T *object = new(pm_allocator::template obtain<T>()) T{std::forward<Args>(args)...};
     pm_allocator::add_ref(object);
     return object;
 }
@@ -416,7 +894,7 @@ template< class T >
 class pm_shared_ptr {
 public:
     ~pm_shared_ptr() {
-        pm_allocator::dec_ref(object_);
+        pm_allocator::dec_ref(object_.get());
     }
 
     explicit pm_shared_ptr(T *object)
@@ -429,7 +907,12 @@ public:
 
     pm_shared_ptr(pm_shared_ptr const &ptr)
         : object_(ptr.object_) {
-        pm_allocator::add_ref(object_);
+        pm_allocator::add_ref(object_.get());
+    }
+
+    pm_shared_ptr(pm_shared_ptr &&ptr)
+        : object_(ptr.object_) {
+        ptr.object_ = nullptr;
     }
 
     pm_shared_ptr &operator=(pm_shared_ptr const &ptr) {
@@ -437,6 +920,11 @@ public:
         return *this;
     }
 
+    pm_shared_ptr &operator=(pm_shared_ptr &&ptr) {
+        pm_shared_ptr(std::move(ptr)).swap(*this);
+        return *this;
+    }
+
     bool operator==(pm_shared_ptr const &ptr) const {
         return object_ == ptr.object_;
     }
@@ -458,12 +946,12 @@ public:
     }
 
     inline T *obtain_rawptr() {
-        pm_allocator::add_ref(object_);
+        pm_allocator::add_ref(object_.get());
         return object_;
     }
 
     inline void release_rawptr() {
-        pm_allocator::dec_ref(object_);
+        pm_allocator::dec_ref(object_.get());
     }
 
     void clear() {
@@ -476,17 +964,17 @@ public:
         std::swap(object_, ptr.object_);
     }
 
-    T *object_;
+    pm_arena_ptr<T> object_;
 };
 
 template< class T, class... Args >
 inline pm_shared_ptr<T> pm_make_shared(Args&&... args) {
-    return pm_shared_ptr<T>(pm_new<T>(args...));
+    return pm_shared_ptr<T>(pm_new<T>(std::forward<Args>(args)...));
 }
 
 template< class T, class B, class... Args >
 inline pm_shared_ptr<B> pm_make_shared2(Args&&... args) {
-    return pm_shared_ptr<B>(pm_new<T>(args...));
+    return pm_shared_ptr<B>(pm_new<T>(std::forward<Args>(args)...));
 }
 
 template<typename FUNC>
@@ -502,7 +990,7 @@ class pm_shared_ptr_promise {
     typedef pm_shared_ptr_promise Defer;
 public:
     ~pm_shared_ptr_promise() {
-        pm_allocator::dec_ref(object_);
+        pm_allocator::dec_ref(object_.get());
     }
 
     explicit pm_shared_ptr_promise(T *object)
@@ -515,12 +1003,17 @@ public:
 
     pm_shared_ptr_promise(pm_shared_ptr_promise const &ptr)
         : object_(ptr.object_) {
-        pm_allocator::add_ref(object_);
+        pm_allocator::add_ref(object_.get());
+    }
+
+    pm_shared_ptr_promise(pm_shared_ptr_promise &&ptr)
+        : object_(ptr.object_) {
+        ptr.object_ = nullptr;
     }
 
     pm_shared_ptr_promise(pm_shared_ptr<T> const &ptr)
         : object_(ptr.object_) {
-        pm_allocator::add_ref(object_);
+        pm_allocator::add_ref(object_.get());
     }
 
     Defer &operator=(Defer const &ptr) {
@@ -528,6 +1021,11 @@ public:
         return *this;
     }
 
+    Defer &operator=(Defer &&ptr) {
+        Defer(std::move(ptr)).swap(*this);
+        return *this;
+    }
+
     bool operator==(Defer const &ptr) const {
         return object_ == ptr.object_;
     }
@@ -549,12 +1047,12 @@ public:
     }
 
     inline T *obtain_rawptr() {
-        pm_allocator::add_ref(object_);
+        pm_allocator::add_ref(object_.get());
         return object_;
     }
 
     inline void release_rawptr() {
-        pm_allocator::dec_ref(object_);
+        pm_allocator::dec_ref(object_.get());
     }
 
     Defer find_pending() const {
@@ -584,17 +1082,17 @@ public:
 
     template <typename FUNC_ON_RESOLVED, typename FUNC_ON_REJECTED>
     Defer then(FUNC_ON_RESOLVED on_resolved, FUNC_ON_REJECTED on_rejected) const {
-        return object_->template then<FUNC_ON_RESOLVED, FUNC_ON_REJECTED>(on_resolved, on_rejected);
+        return object_->template then<FUNC_ON_RESOLVED, FUNC_ON_REJECTED>(std::move(on_resolved), std::move(on_rejected));
     }
 
     template <typename FUNC_ON_RESOLVED>
     Defer then(FUNC_ON_RESOLVED on_resolved) const {
-        return object_->template then<FUNC_ON_RESOLVED>(on_resolved);
+        return object_->template then<FUNC_ON_RESOLVED>(std::move(on_resolved));
     }
 
     template <typename FUNC_ON_REJECTED>
     Defer fail(FUNC_ON_REJECTED on_rejected) const {
-        return object_->template fail<FUNC_ON_REJECTED>(on_rejected);
+        return object_->template fail<FUNC_ON_REJECTED>(std::move(on_rejected));
     }
 
     template <typename FUNC_ON_ALWAYS>
@@ -612,7 +1110,7 @@ private:
         std::swap(object_, ptr.object_);
     }
 
-    T *object_;
+    pm_arena_ptr<T> object_;
 };
 
 typedef pm_shared_ptr_promise<Promise> Defer;
@@ -627,10 +1125,20 @@ struct RejectChecker;
 inline Defer reject(void);
 inline Defer newHeadPromise(void);
 
+#ifdef PM_NO_VTABLE
+#define PM_VIRTUAL
+
+/* Base of the callers, which are called through Promise::invoke_ */
+struct PromiseCaller{
+};
+#else
+#define PM_VIRTUAL virtual
+
 struct PromiseCaller{
     virtual ~PromiseCaller(){};
     virtual Defer call(Defer &self) = 0;
 };
+#endif
 
 template <typename FUNC_ON_RESOLVED>
 struct ResolvedCaller
@@ -638,10 +1146,10 @@ struct ResolvedCaller
     typedef typename func_traits<FUNC_ON_RESOLVED>::ret_type resolve_ret_type;
     FUNC_ON_RESOLVED on_resolved_;
 
-    ResolvedCaller(const FUNC_ON_RESOLVED &on_resolved)
-        : on_resolved_(on_resolved){}
+    ResolvedCaller(FUNC_ON_RESOLVED on_resolved)
+        : on_resolved_(std::move(on_resolved)){}
 
-    virtual Defer call(Defer &self) {
+    PM_VIRTUAL Defer call(Defer &self) {
         return ResolveChecker<resolve_ret_type, FUNC_ON_RESOLVED>::call(on_resolved_, self);
     }
 };
@@ -652,20 +1160,91 @@ struct RejectedCaller
     typedef typename func_traits<FUNC_ON_REJECTED>::ret_type reject_ret_type;
     FUNC_ON_REJECTED on_rejected_;
 
-    RejectedCaller(const FUNC_ON_REJECTED &on_rejected)
-        : on_rejected_(on_rejected){}
+    RejectedCaller(FUNC_ON_REJECTED on_rejected)
+        : on_rejected_(std::move(on_rejected)){}
 
-    virtual Defer call(Defer &self) {
+    PM_VIRTUAL Defer call(Defer &self) {
         return RejectChecker<reject_ret_type, FUNC_ON_REJECTED>::call(on_rejected_, self);
     }
 };
 
+/* Makes the caller of then(), in the block of the promise or obtained apart.
+   CALLER is void if there is no function */
+template <typename CALLER>
+struct caller_maker {
+    /* Bytes taken in the block of the promise */
+    static const size_t size = (sizeof(CALLER) + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+    /* The block of the promise is aligned as a pointer */
+    static const bool fits = (alignof(CALLER) <= alignof(void *));
+
+    template <typename FUNC>
+    static PromiseCaller *make(void *buf, FUNC &&func) {
+        return new(buf) CALLER(std::forward<FUNC>(func));
+    }
+
+    template <typename FUNC>
+    static PromiseCaller *obtain(FUNC &&func) {
+        return pm_new<CALLER>(std::forward<FUNC>(func));
+    }
+
+#ifdef PM_NO_VTABLE
+    static Defer call(PromiseCaller *callee, Defer &self) {
+        return static_cast<CALLER *>(callee)->call(self);
+    }
+
+    static void destroy(PromiseCaller *caller, bool in_block) {
+        if (in_block)
+            static_cast<CALLER *>(caller)->~CALLER();
+        else
+            pm_delete(static_cast<CALLER *>(caller));
+    }
+#endif
+};
+
+template <>
+struct caller_maker<void> {
+    static const size_t size = 0;
+    static const bool fits = true;
+
+    template <typename FUNC>
+    static PromiseCaller *make(void *, const FUNC &) {
+        return nullptr;
+    }
+
+    template <typename FUNC>
+    static PromiseCaller *obtain(const FUNC &) {
+        return nullptr;
+    }
+
+#ifdef PM_NO_VTABLE
+    static Defer call(PromiseCaller *, Defer &self) {
+        return self;
+    }
+
+    static void destroy(PromiseCaller *, bool) {
+    }
+#endif
+};
+
+template <bool INLINE, size_t SIZE>
+struct caller_node;
 
 struct Promise {
     Defer next_;
     pm_stack::itr_t prev_;
-    PromiseCaller *resolved_;
-    PromiseCaller *rejected_;
+#ifdef PM_NO_VTABLE
+    /* Calls on_resolved or on_rejected of then(), and destroys both */
+    Defer (*invoke_)(Promise *promise, bool rejected, Defer &self);
+    void (*destroy_)(Promise *promise);
+#else
+    pm_arena_ptr<PromiseCaller> resolved_;
+    pm_arena_ptr<PromiseCaller> rejected_;
+#endif
+    /* Link in the ready list, timer list or irq waiting list,
+       pm_stack::itr_t drops the low address bits so it is aligned as a pointer */
+    alignas(void *) pm_list list_;
+    /* The other end of the chain, kept by its head and its tail only */
+    pm_stack::itr_t end_;
 
     enum status_t {
         kInit       = 0,
@@ -673,7 +1252,18 @@ struct Promise {
         kRejected   = 2,
         kFinished   = 3
     };
-    uint8_t status_      ;//: 2;
+    /* Bit fields share a byte, so end_ takes no room after list_ */
+    uint8_t status_     : 2;
+#ifdef PM_NO_VTABLE
+    enum caller_t {
+        kResolvedCaller = 1,
+        kRejectedCaller = 2
+    };
+    uint8_t callers_    : 2;    /* Functions of then() called by invoke_ */
+#else
+    uint8_t inline_     : 1;    /* The callers are in the block of the promise */
+#endif
+    uint8_t priority_;
 
 #ifdef PM_DEBUG
     uint32_t type_;
@@ -683,9 +1273,22 @@ struct Promise {
     explicit Promise()
         : next_(nullptr)
         , prev_(pm_stack::ptr_to_itr(nullptr))
+#ifdef PM_NO_VTABLE
+        , invoke_(nullptr)
+        , destroy_(nullptr)
+#else
         , resolved_(nullptr)
         , rejected_(nullptr)
+#endif
+        , list_()
+        , end_(pm_stack::ptr_to_itr(nullptr))
         , status_(kInit)
+#ifdef PM_NO_VTABLE
+        , callers_(0)
+#else
+        , inline_(0)
+#endif
+        , priority_(current_priority())
 #ifdef PM_DEBUG
         , type_(PM_TYPE_NONE)
 #endif
@@ -694,13 +1297,32 @@ struct Promise {
         //printf("prev_ = %x %x, start = %x\n", (int)prev_, pm_stack::itr_to_ptr(prev_), pm_stack::start());
     }
 
-    virtual ~Promise() {
+    /* Classes derived from Promise must not need their destructor with PM_NO_VTABLE */
+    PM_VIRTUAL ~Promise() {
         clear_func();
-        if (next_.operator->()) {
-            next_->prev_ = pm_stack::ptr_to_itr(nullptr);
+        /* The rest of the chain is released in this loop instead of the
+           destructors calling each other, the stack does not grow with its length */
+        Promise *tail = get_tail(this);
+        Defer next(std::move(next_));
+        while (next.operator->() != nullptr) {
+            next->prev_ = pm_stack::ptr_to_itr(nullptr);
+            if (pm_allocator::ref_count(next.operator->()) != 1) {
+                /* It is held elsewhere and becomes the head */
+                if (next.operator->() != tail)
+                    set_ends(next.operator->(), tail);
+                break;
+            }
+            Defer after(std::move(next->next_));
+            next = std::move(after);
         }
     }
 
+    /* Priority of new promises, inherited from the promise being run */
+    static uint8_t &current_priority() {
+        static uint8_t priority = 0;
+        return priority;
+    }
+
     void prepare_resolve() {
         if (status_ != kInit) return;
         status_ = kResolved;
@@ -724,7 +1346,11 @@ struct Promise {
     }
 
     Defer call_resolve(Defer &self){
+#ifdef PM_NO_VTABLE
+        if((callers_ & kResolvedCaller) == 0){
+#else
         if(resolved_ == nullptr){
+#endif
             self->prepare_resolve();
             return self;
         }
@@ -732,7 +1358,11 @@ struct Promise {
 #ifdef PM_MAX_CALL_LEN
         if(g_promise_call_len > PM_MAX_CALL_LEN) pm_throw("PM_MAX_CALL_LEN");
 #endif
+#ifdef PM_NO_VTABLE
+        Defer ret = invoke_(this, false, self);
+#else
         Defer ret = resolved_->call(self);
+#endif
         --g_promise_call_len;
         if (ret != self) {
             joinDeferObject(self, ret);
@@ -742,7 +1372,11 @@ struct Promise {
     }
 
     Defer call_reject(Defer &self){
+#ifdef PM_NO_VTABLE
+        if((callers_ & kRejectedCaller) == 0){
+#else
         if(rejected_ == nullptr){
+#endif
             self->prepare_reject();
             return self;
         }
@@ -750,7 +1384,11 @@ struct Promise {
 #ifdef PM_MAX_CALL_LEN
         if(g_promise_call_len > PM_MAX_CALL_LEN) pm_throw("PM_MAX_CALL_LEN");
 #endif
+#ifdef PM_NO_VTABLE
+        Defer ret = invoke_(this, true, self);
+#else
         Defer ret = rejected_->call(self);
+#endif
         --g_promise_call_len;
         if (ret != self) {
             joinDeferObject(self, ret);
@@ -760,51 +1398,69 @@ struct Promise {
     }
 
     void clear_func() {
-        pm_delete(resolved_);
+#ifdef PM_NO_VTABLE
+        void (*destroy)(Promise *promise) = destroy_;
+        invoke_ = nullptr;
+        destroy_ = nullptr;
+        callers_ = 0;
+        if (destroy != nullptr)
+            destroy(this);
+#else
+        if (inline_) {
+            /* The block is released with the promise */
+            if (resolved_ != nullptr) resolved_->~PromiseCaller();
+            if (rejected_ != nullptr) rejected_->~PromiseCaller();
+        }
+        else {
+            pm_delete(resolved_.get());
+            pm_delete(rejected_.get());
+        }
         resolved_ = nullptr;
-        pm_delete(rejected_);
         rejected_ = nullptr;
+#endif
     }
 
 
+    /* Run the function of next_ for the status of this promise, return the
+       promise it returned, or an empty Defer if there is nothing to run */
+    Defer call_next_once() {
+        if((status_ != kResolved && status_ != kRejected) || next_.operator->() == nullptr)
+            return Defer();
+        pm_allocator::add_ref(this);
+        bool rejected = (status_ == kRejected);
+        status_ = kFinished;
+        Defer d = rejected ? next_->call_reject(next_) : next_->call_resolve(next_);
+        /* next_ is empty if its function cut the chain, as doLoop() does */
+        if(next_.operator->() != nullptr)
+            next_->clear_func();
+        pm_allocator::dec_ref(this);
+        return d;
+    }
+
     Defer call_next() {
-        if(status_ == kResolved) {
-            if(next_.operator->()){
-                pm_allocator::add_ref(this);
-                status_ = kFinished;
-                Defer d = next_->call_resolve(next_);
-                next_->clear_func();
-                if(d.operator->())
-                    d->call_next();
-                //next_.clear();
-                pm_allocator::dec_ref(this);
-                return d;
-            }
+        if((status_ != kResolved && status_ != kRejected) || next_.operator->() == nullptr)
+            return next_;
+        Defer d = call_next_once();
+        /* The rest of the chain runs in this loop instead of recursion,
+           the stack does not grow with its length */
+        if(d.operator->() != nullptr){
+            Defer p = d->call_next_once();
+            while(p.operator->() != nullptr)
+                p = p->call_next_once();
         }
-        else if(status_ == kRejected ) {
-            if(next_.operator->()){
-                pm_allocator::add_ref(this);
-                status_ = kFinished;
-                Defer d =  next_->call_reject(next_);
-                next_->clear_func();
-                if (d.operator->())
-                    d->call_next();
-                //next_.clear();
-                pm_allocator::dec_ref(this);
-                return d;
-            }
-        }
-
-        return next_;
+        return d;
     }
 
 
+#ifndef PM_NO_VTABLE
     Defer then_impl(PromiseCaller *resolved, PromiseCaller *rejected){
         Defer promise = newHeadPromise();
+        promise->priority_ = priority_;
         promise->resolved_ = resolved;
         promise->rejected_ = rejected;
         return then(promise);
     }
+#endif
 
     Defer then(Defer &promise) {
         joinDeferObject(this, promise);
@@ -812,22 +1468,35 @@ struct Promise {
         return call_next();
     }
 
+    /* RESOLVED_CALLER or REJECTED_CALLER is void if there is no function */
+    template <typename RESOLVED_CALLER, typename REJECTED_CALLER, typename FUNC_ON_RESOLVED, typename FUNC_ON_REJECTED>
+    Defer then_callers(FUNC_ON_RESOLVED &&on_resolved, FUNC_ON_REJECTED &&on_rejected) {
+        typedef caller_maker<RESOLVED_CALLER> resolved_maker;
+        typedef caller_maker<REJECTED_CALLER> rejected_maker;
+        enum { size = resolved_maker::size + rejected_maker::size };
+        enum { fits = resolved_maker::fits && rejected_maker::fits && size <= PM_INLINE_CALLER };
+        Defer promise = caller_node<fits, size>::template
+            make<resolved_maker, rejected_maker>(std::forward<FUNC_ON_RESOLVED>(on_resolved),
+                                                 std::forward<FUNC_ON_REJECTED>(on_rejected));
+        promise->priority_ = priority_;
+        return then(promise);
+    }
+
+    /* The functions are taken by value and moved into the callers */
     template <typename FUNC_ON_RESOLVED, typename FUNC_ON_REJECTED>
-    Defer then(const FUNC_ON_RESOLVED &on_resolved, const FUNC_ON_REJECTED &on_rejected) {
-        return then_impl(static_cast<PromiseCaller *>(pm_new<ResolvedCaller<FUNC_ON_RESOLVED>>(on_resolved)),
-                         static_cast<PromiseCaller *>(pm_new<RejectedCaller<FUNC_ON_REJECTED>>(on_rejected)));
+    Defer then(FUNC_ON_RESOLVED on_resolved, FUNC_ON_REJECTED on_rejected) {
+        return then_callers<ResolvedCaller<FUNC_ON_RESOLVED>, RejectedCaller<FUNC_ON_REJECTED>>(
+            std::move(on_resolved), std::move(on_rejected));
     }
 
     template <typename FUNC_ON_RESOLVED>
-    Defer then(const FUNC_ON_RESOLVED &on_resolved) {
-        return then_impl(static_cast<PromiseCaller *>(pm_new<ResolvedCaller<FUNC_ON_RESOLVED>>(on_resolved)),
-                         static_cast<PromiseCaller *>(nullptr));
+    Defer then(FUNC_ON_RESOLVED on_resolved) {
+        return then_callers<ResolvedCaller<FUNC_ON_RESOLVED>, void>(std::move(on_resolved), nullptr);
     }
 
     template <typename FUNC_ON_REJECTED>
-    Defer fail(const FUNC_ON_REJECTED &on_rejected) {
-        return then_impl(static_cast<PromiseCaller *>(nullptr),
-                         static_cast<PromiseCaller *>(pm_new<RejectedCaller<FUNC_ON_REJECTED>>(on_rejected)));
+    Defer fail(FUNC_ON_REJECTED on_rejected) {
+        return then_callers<void, RejectedCaller<FUNC_ON_REJECTED>>(nullptr, std::move(on_rejected));
     }
 
     template <typename FUNC_ON_ALWAYS>
@@ -864,6 +1533,10 @@ struct Promise {
     Defer find_pending() {
         if (status_ == kInit) {
             Promise *p = this;
+            /* A chain settles from its head, so the tail of a chain whose
+               head is pending finds it at once */
+            if (next_.operator->() == nullptr && get_head(this)->status_ == kInit)
+                p = get_head(this);
             Promise *prev = static_cast<Promise *>(pm_stack::itr_to_ptr(p->prev_));
             //printf("3prev_ = %d %x\n", (int)p->prev_, pm_stack::itr_to_ptr(p->prev_));
             while (prev != nullptr) {
@@ -896,7 +1569,21 @@ struct Promise {
             pending.reject();
     }
 
+    static Promise *get_end(Promise *p){
+        return static_cast<Promise *>(pm_stack::itr_to_ptr(p->end_));
+    }
+    static void set_ends(Promise *head, Promise *tail){
+        head->end_ = pm_stack::ptr_to_itr(reinterpret_cast<void *>(tail));
+        tail->end_ = pm_stack::ptr_to_itr(reinterpret_cast<void *>(head));
+    }
+
+    /* The head and the tail of a chain find each other through end_,
+       only a promise in the middle walks the chain */
     static Promise *get_head(Promise *p){
+        if(p->prev_ == pm_stack::ptr_to_itr(nullptr))
+            return p;
+        if(p->next_.operator->() == nullptr)
+            return get_end(p);
         while(p){
             Promise *prev = static_cast<Promise *>(pm_stack::itr_to_ptr(p->prev_));
             if(prev == nullptr) break;
@@ -905,6 +1592,10 @@ struct Promise {
         return p;
     }
     static Promise *get_tail(Promise *p){
+        if(p->next_.operator->() == nullptr)
+            return p;
+        if(p->prev_ == pm_stack::ptr_to_itr(nullptr))
+            return get_end(p);
         while(p){
             Defer &next = p->next_;
             if(next.operator->() == nullptr) break;
@@ -912,8 +1603,9 @@ struct Promise {
         }
         return p;
     }
-    
-    
+
+    /* Insert the chain of next after self, both ends of the chain of next
+       are found at once when next is one of them */
     static inline void joinDeferObject(Promise *self, Defer &next){
         /* Check if there's any functions return null Defer object */
         pm_assert(next.operator->() != nullptr);
@@ -923,20 +1615,120 @@ struct Promise {
 
         if(self->next_.operator->()){
             self->next_->prev_ = pm_stack::ptr_to_itr(reinterpret_cast<void *>(tail));
-            //printf("5prev_ = %d %x\n", (int)self->next_->prev_, pm_stack::itr_to_ptr(self->next_->prev_));
+        }
+        else {
+            /* The chain of self gets a new tail */
+            set_ends(get_head(self), tail);
         }
         tail->next_ = self->next_;
         pm_allocator::add_ref(head);
         self->next_ = Defer(head);
         head->prev_ = pm_stack::ptr_to_itr(reinterpret_cast<void *>(self));
-        //printf("6prev_ = %d %x\n", (int)next->prev_, pm_stack::itr_to_ptr(next->prev_));
     }
 
     static inline void joinDeferObject(Defer &self, Defer &next){
         joinDeferObject(self.operator->(), next);
     }
+
+    /* Cut the chain after self, return the promise that followed it */
+    static inline Defer splitDeferObject(Promise *self){
+        Promise *head = get_head(self);
+        Promise *tail = get_tail(self);
+        Defer next(std::move(self->next_));
+        if(next.operator->() != nullptr){
+            next->prev_ = pm_stack::ptr_to_itr(nullptr);
+            if(head != self)
+                set_ends(head, self);
+            if(next.operator->() != tail)
+                set_ends(next.operator->(), tail);
+        }
+        return next;
+    }
 };
 
+/* Promise followed by the callers of then() */
+template <size_t SIZE>
+struct CallerPromise : public Promise {
+    void *buf_[SIZE / sizeof(void *)];
+
+    CallerPromise() {
+    }
+};
+
+#ifdef PM_NO_VTABLE
+/* The callers are in buf_, or obtained apart and pointed to by buf_ */
+template <bool INLINE, size_t SIZE>
+struct caller_node {
+    typedef CallerPromise<(INLINE ? SIZE : 2 * sizeof(void *))> node_type;
+
+    template <typename RESOLVED_MAKER, typename REJECTED_MAKER, typename FUNC_ON_RESOLVED, typename FUNC_ON_REJECTED>
+    static Defer make(FUNC_ON_RESOLVED &&on_resolved, FUNC_ON_REJECTED &&on_rejected) {
+        node_type *promise = pm_new<node_type>();
+        if (INLINE) {
+            char *buf = reinterpret_cast<char *>(promise->buf_);
+            RESOLVED_MAKER::make(buf, std::forward<FUNC_ON_RESOLVED>(on_resolved));
+            REJECTED_MAKER::make(buf + RESOLVED_MAKER::size, std::forward<FUNC_ON_REJECTED>(on_rejected));
+        }
+        else {
+            PromiseCaller **callers = reinterpret_cast<PromiseCaller **>(promise->buf_);
+            callers[0] = RESOLVED_MAKER::obtain(std::forward<FUNC_ON_RESOLVED>(on_resolved));
+            callers[1] = REJECTED_MAKER::obtain(std::forward<FUNC_ON_REJECTED>(on_rejected));
+        }
+        promise->invoke_ = &invoke<RESOLVED_MAKER, REJECTED_MAKER>;
+        promise->destroy_ = &destroy<RESOLVED_MAKER, REJECTED_MAKER>;
+        promise->callers_ = (RESOLVED_MAKER::size != 0 ? Promise::kResolvedCaller : 0)
+                          | (REJECTED_MAKER::size != 0 ? Promise::kRejectedCaller : 0);
+        return Defer(promise);
+    }
+
+    template <typename RESOLVED_MAKER>
+    static PromiseCaller *get(Promise *promise, bool rejected) {
+        void **buf = static_cast<node_type *>(promise)->buf_;
+        if (INLINE)
+            return reinterpret_cast<PromiseCaller *>(reinterpret_cast<char *>(buf) + (rejected ? RESOLVED_MAKER::size : 0));
+        return reinterpret_cast<PromiseCaller **>(buf)[rejected ? 1 : 0];
+    }
+
+    template <typename RESOLVED_MAKER, typename REJECTED_MAKER>
+    static Defer invoke(Promise *promise, bool rejected, Defer &self) {
+        PromiseCaller *callee = get<RESOLVED_MAKER>(promise, rejected);
+        if (rejected)
+            return REJECTED_MAKER::call(callee, self);
+        return RESOLVED_MAKER::call(callee, self);
+    }
+
+    template <typename RESOLVED_MAKER, typename REJECTED_MAKER>
+    static void destroy(Promise *promise) {
+        RESOLVED_MAKER::destroy(get<RESOLVED_MAKER>(promise, false), INLINE);
+        REJECTED_MAKER::destroy(get<RESOLVED_MAKER>(promise, true), INLINE);
+    }
+};
+#else
+template <size_t SIZE>
+struct caller_node<true, SIZE> {
+    template <typename RESOLVED_MAKER, typename REJECTED_MAKER, typename FUNC_ON_RESOLVED, typename FUNC_ON_REJECTED>
+    static Defer make(FUNC_ON_RESOLVED &&on_resolved, FUNC_ON_REJECTED &&on_rejected) {
+        CallerPromise<SIZE> *promise = pm_new<CallerPromise<SIZE>>();
+        char *buf = reinterpret_cast<char *>(promise->buf_);
+        promise->inline_ = 1;
+        promise->resolved_ = RESOLVED_MAKER::make(buf, std::forward<FUNC_ON_RESOLVED>(on_resolved));
+        promise->rejected_ = REJECTED_MAKER::make(buf + RESOLVED_MAKER::size, std::forward<FUNC_ON_REJECTED>(on_rejected));
+        return Defer(promise);
+    }
+};
+
+template <size_t SIZE>
+struct caller_node<false, SIZE> {
+    template <typename RESOLVED_MAKER, typename REJECTED_MAKER, typename FUNC_ON_RESOLVED, typename FUNC_ON_REJECTED>
+    static Defer make(FUNC_ON_RESOLVED &&on_resolved, FUNC_ON_REJECTED &&on_rejected) {
+        Defer promise = newHeadPromise();
+        promise->resolved_ = RESOLVED_MAKER::obtain(std::forward<FUNC_ON_RESOLVED>(on_resolved));
+        promise->rejected_ = REJECTED_MAKER::obtain(std::forward<FUNC_ON_REJECTED>(on_rejected));
+        return promise;
+    }
+};
+#endif
+
 
 template <typename RET, typename FUNC>
 struct ResolveChecker {
@@ -1007,6 +1799,19 @@ inline Defer newPromise(FUNC func) {
     return promise;
 }
 
+/* Create new promise object in priority class 0 ~ PM_PRIORITY_LEVELS-1,
+   promises created in func inherit the priority */
+template <typename FUNC>
+inline Defer newPromise(FUNC func, uint8_t priority) {
+    uint8_t &current = Promise::current_priority();
+    uint8_t parent = current;
+    current = (priority < PM_PRIORITY_LEVELS ? priority : PM_PRIORITY_LEVELS - 1);
+    Defer promise = newHeadPromise();
+    func(promise);
+    current = parent;
+    return promise;
+}
+
 /*
  * While loop func call resolved, 
  * It is not safe since the promise chain will become longer infinitely 
@@ -1027,6 +1832,111 @@ inline Defer doWhile(FUNC func) {
     });
 }
 
+#ifndef PM_NO_VTABLE
+template <typename LOOP, bool REJECTED>
+struct LoopCaller
+    : public PromiseCaller{
+    virtual Defer call(Defer &self) {
+        return static_cast<LOOP *>(self.operator->())->step(self, REJECTED);
+    }
+};
+#endif
+
+/* Promise of doLoop(). The body of each iteration is linked before it and cut
+   off again when it is settled, so the bodies are reused instead of obtained */
+template <typename FUNC>
+struct LoopPromise : public Promise {
+    FUNC func_;
+    Defer spare_;       /* A body cut off before, reused when nothing holds it */
+    bool running_;      /* func_ is being called */
+    bool again_;        /* The body was resolved while func_ was called */
+#ifndef PM_NO_VTABLE
+    void *callers_buf_[2];
+#endif
+
+    LoopPromise(FUNC func)
+        : Promise()
+        , func_(std::move(func))
+        , spare_()
+        , running_(false)
+        , again_(false) {
+#ifdef PM_NO_VTABLE
+        invoke_ = &invoke;
+        destroy_ = &destroy;
+        callers_ = kResolvedCaller | kRejectedCaller;
+#else
+        inline_ = 1;
+        resolved_ = new(&callers_buf_[0]) LoopCaller<LoopPromise, false>();
+        rejected_ = new(&callers_buf_[1]) LoopCaller<LoopPromise, true>();
+#endif
+    }
+
+#ifdef PM_NO_VTABLE
+    static Defer invoke(Promise *promise, bool rejected, Defer &self) {
+        return static_cast<LoopPromise *>(promise)->step(self, rejected);
+    }
+
+    /* The destructor of LoopPromise is not called with PM_NO_VTABLE */
+    static void destroy(Promise *promise) {
+        LoopPromise *loop = static_cast<LoopPromise *>(promise);
+        loop->func_.~FUNC();
+        loop->spare_.clear();
+    }
+#endif
+
+    /* The body linked before this promise is settled */
+    Defer step(Defer &self, bool rejected) {
+        Promise *body = static_cast<Promise *>(pm_stack::itr_to_ptr(prev_));
+        pm_allocator::add_ref(body);
+        Defer last(body);
+        /* self is next_ of the body and is emptied here, so the body neither
+           clears the functions of this promise nor runs what follows it */
+        Defer loop = splitDeferObject(body);
+        if (rejected) {
+            prepare_reject();
+            call_next();
+        }
+        else if (running_)
+            again_ = true;
+        else if (status_ == kInit)
+            run(loop, std::move(last));
+        return self;
+    }
+
+    /* Call func_ until the body is not resolved in place */
+    void run(Defer &loop, Defer body) {
+        running_ = true;
+        do {
+            again_ = false;
+            /* Reuse the last body if nothing else holds it, or else the spare one */
+            if (body.operator->() == nullptr || pm_allocator::ref_count(body.operator->()) != 1) {
+                Defer spare(std::move(spare_));
+                if (body.operator->() != nullptr)
+                    spare_ = std::move(body);
+                if (spare.operator->() != nullptr && pm_allocator::ref_count(spare.operator->()) == 1)
+                    body = std::move(spare);
+                else
+                    body = newHeadPromise();
+            }
+            body->status_ = kInit;
+            body->priority_ = priority_;
+            joinDeferObject(body.operator->(), loop);
+            func_(body);
+        } while (again_ && status_ == kInit);
+        running_ = false;
+    }
+};
+
+/* While loop func call resolved, as doWhile(), but the promise passed to func
+   is reused by later iterations, so it must not be used after it is settled */
+template <typename FUNC>
+inline Defer doLoop(FUNC func) {
+    LoopPromise<FUNC> *promise = pm_new<LoopPromise<FUNC>>(std::move(func));
+    Defer loop(promise);
+    promise->run(loop, Defer());
+    return loop;
+}
+
 /* Return a rejected promise directly */
 inline Defer reject(){
     return newPromise([](Defer &d){ d.reject(); });
@@ -1047,7 +1957,92 @@ namespace promise{
 inline void pm_run(){
     pm_timer::run();
     irq_x::run();
+#if PM_PRIORITY_LEVELS > 1
+    /* Poll irq after each promise, so that a higher priority promise woken
+       meanwhile does not wait for the rest of the lower priority ones */
+    while(defer_list::run_one())
+        irq_x::run();
+#else
     defer_list::run();
+#endif
+}
+
+/* Run the timers, irqs and a snapshot of the ready promises, promises made
+   ready meanwhile (e.g. by yield() or doWhile loops) wait for the next call.
+   With PM_PRIORITY_LEVELS > 1 irqs are polled after each promise as in
+   pm_run(), and a promise they wake of a higher priority than the one just
+   run joins the snapshot.
+   Stops after max_callbacks promises or max_ticks ticks, 0 for no limit.
+   Returns the number of ready promises left. A promise it runs may call
+   pm_run(), but not pm_run_for().
+ */
+inline uint32_t pm_run_for(uint32_t max_callbacks, uint32_t max_ticks = 0){
+    pm_run_stats *stats = defer_list::get_stats();
+    uint32_t start = pm_timer::get_ticks();
+    uint32_t callbacks = 0;
+
+    pm_timer::run();
+    irq_x::run();
+    defer_list::snapshot();
+    while(defer_list::run_snapshot_one()){
+        ++callbacks;
+#if PM_PRIORITY_LEVELS > 1
+        irq_x::run();
+#endif
+        if(max_callbacks != 0 && callbacks >= max_callbacks)
+            break;
+        if(max_ticks != 0 && pm_timer::get_ticks() - start >= max_ticks)
+            break;
+    }
+    uint32_t left = defer_list::drop_snapshot();
+    uint32_t ticks = pm_timer::get_ticks() - start;
+
+    ++stats->runs_;
+    stats->callbacks_ += callbacks;
+    if(left > 0)
+        ++stats->overruns_;
+    stats->last_depth_ = callbacks + left;
+    if(stats->last_depth_ > stats->max_depth_)
+        stats->max_depth_ = stats->last_depth_;
+    if(ticks > stats->max_ticks_)
+        stats->max_ticks_ = ticks;
+
+    return (defer_list::empty() ? 0 : defer_list::size());
+}
+
+/* Create the lists of the runtime and take no more memory from the arena,
+   pm_throw("frozen") is called on any later arena allocation. Call it at
+   the end of init, after pm_allocator::reserve() and irq<IRQ>::init().
+ */
+inline void pm_freeze(){
+    pm_memory_pool::get_pools();
+#ifdef PM_SLAB_PAGE
+    pm_slab_page::get_free_pages();
+    pm_slab_page::get_stats();
+#endif
+    pm_timer::get_global();
+    defer_list::init();
+    irq_x::init();
+    pm_stack::frozen() = true;
+}
+
+/* Tickless idle, call it after pm_run() instead of __WFE().
+   The periodic tick of CLOCK is stopped until the next timer expires,
+   wait() is called with interrupts disabled and must return on any
+   pending interrupt, e.g. __WFI().
+ */
+template <typename CLOCK, typename FUNC>
+inline void pm_idle(FUNC wait){
+    irq_disable();
+    if(defer_list::empty() && !irq_x::pending()){
+        uint32_t ticks = pm_timer::next_timeout();
+        if(ticks > 0){
+            CLOCK::suspend(ticks);
+            wait();
+            pm_timer::add_ticks(CLOCK::resume());
+        }
+    }
+    irq_enable();
 }
 
 }
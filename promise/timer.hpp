@@ -6,10 +6,44 @@
 
 #define TT_TICKS_PER_SECOND 1000
 
+/* Start the periodic tick interrupt, which calls pm_timer::increase_ticks(),
+   SysTick of Cortex-M by default, see posix.hpp for Linux */
+#ifndef PM_TICK_INIT
+#define PM_TICK_INIT(reload)    SysTick_Config(reload)
+#endif
+
+/* Define PM_TIMER_WHEEL to keep the timers in a hierarchical timing wheel
+   instead of the sorted list. The sorted list walks all timers on every start,
+   the timing wheel starts a timer in O(1) and expires timers in O(1) per tick.
+ */
+//#define PM_TIMER_WHEEL
+
+#ifdef PM_TIMER_WHEEL
+#ifndef PM_TIMER_WHEEL_BITS
+#define PM_TIMER_WHEEL_BITS     3       /* 8 slots in each level */
+#endif
+#ifndef PM_TIMER_WHEEL_LEVELS
+#define PM_TIMER_WHEEL_LEVELS   5       /* 8^5 ticks, longer timers wait in timers_ */
+#endif
+#define PM_TIMER_WHEEL_SLOTS    (1 << PM_TIMER_WHEEL_BITS)
+#define PM_TIMER_WHEEL_MASK     (PM_TIMER_WHEEL_SLOTS - 1)
+#endif
+
 namespace promise{
 
+#ifdef PM_TIMER_WHEEL
+/* pm_stack::itr_t drops the low address bits, each slot must be aligned as a pointer */
+struct timer_slot {
+    alignas(void *) pm_list list_;
+};
+#endif
+
 struct timer_global {
     pm_list  timers_;
+#ifdef PM_TIMER_WHEEL
+    timer_slot wheel_[PM_TIMER_WHEEL_LEVELS][PM_TIMER_WHEEL_SLOTS];
+    uint32_t wheel_ticks_;                      /* the last tick processed by the wheel */
+#endif
     volatile uint64_t current_ticks_;
     volatile uint64_t time_offset_;             /* tt_set_time() only set this value */
 
@@ -21,6 +55,8 @@ struct timer_global {
     volatile uint64_t TT_TICKS_PER_SECOND_1;    /*  TT_TICKS_DEVIDER/TT_TICKS_PER_SECOND for fast devision */
 };
 
+struct TimerPromise;
+
 struct pm_timer {
 
     static inline timer_global *get_global(){
@@ -33,7 +69,7 @@ struct pm_timer {
     static void init_system(uint32_t systick_frequency){
         timer_global *global = pm_timer::get_global();
         global->TT_TICKS_PER_SECOND_1 = TT_TICKS_DEVIDER / TT_TICKS_PER_SECOND;
-        SysTick_Config(systick_frequency / TT_TICKS_PER_SECOND);
+        PM_TICK_INIT(systick_frequency / TT_TICKS_PER_SECOND);
     }
     
     static void increase_ticks(){
@@ -41,6 +77,12 @@ struct pm_timer {
         global->current_ticks_++;
     }
 
+    /* Add ticks passed while the periodic tick was stopped by pm_idle() */
+    static void add_ticks(uint32_t ticks){
+        timer_global *global = pm_timer::get_global();
+        global->current_ticks_ += ticks;
+    }
+
     static uint64_t get_time(){
         timer_global *global = pm_timer::get_global();
         uint64_t u64_ticks_offset = global->time_offset_ * TT_TICKS_PER_SECOND;
@@ -80,48 +122,150 @@ struct pm_timer {
         return ticks;
     }
 
+    static inline pm_timer *from_list(pm_list *node);
+    static inline pm_timer *from_defer(const Defer &defer);
+
+    /* Move the promise from the timer list to the ready list, the reference goes with it */
+    static void expire(pm_list *node){
+        defer_list::ready(node);
+    }
+
+#ifdef PM_TIMER_WHEEL
+    /* Put the timer in the lowest level that can hold its wakeup ticks */
+    static void wheel_insert(timer_global *global, pm_list *node, uint32_t wakeup_ticks){
+        uint32_t ticks = wakeup_ticks - global->wheel_ticks_;
+        if((int32_t)ticks < 0){
+            ticks = 0;
+            wakeup_ticks = global->wheel_ticks_;
+        }
+
+        pm_list *slot = &global->timers_;
+        for(size_t level = 0; level < PM_TIMER_WHEEL_LEVELS; ++level){
+            if((uint64_t)ticks < ((uint64_t)PM_TIMER_WHEEL_SLOTS << (level * PM_TIMER_WHEEL_BITS))){
+                slot = &global->wheel_[level][(wakeup_ticks >> (level * PM_TIMER_WHEEL_BITS)) & PM_TIMER_WHEEL_MASK].list_;
+                break;
+            }
+        }
+        slot->attach(node);
+    }
+
+    /* Move timers in the slot down to lower levels */
+    static void wheel_cascade(timer_global *global, pm_list *slot){
+        if(slot->empty()) return;
+
+        /* Timers still out of range are put back to tail of timers_, stop at the last old one */
+        pm_list *last = slot->prev();
+        pm_list *node = slot->next();
+        while(true){
+            pm_list *node_next = node->next();
+            node->detach();
+            wheel_insert(global, node, pm_timer::from_list(node)->wakeup_ticks_);
+            if(node == last) break;
+            node = node_next;
+        }
+    }
+
+    static void wheel_run(timer_global *global, uint32_t current_ticks){
+        while(true){
+            /* Timers started after the last run may wait in the slot of wheel_ticks_ */
+            pm_list *slot = &global->wheel_[0][global->wheel_ticks_ & PM_TIMER_WHEEL_MASK].list_;
+            while(!slot->empty())
+                pm_timer::expire(slot->next());
+
+            if(global->wheel_ticks_ == current_ticks) break;
+            uint32_t ticks = ++global->wheel_ticks_;
+
+            /* Lower level wrapped, cascade the upper level */
+            size_t level = 1;
+            for(; level < PM_TIMER_WHEEL_LEVELS; ++level){
+                if((ticks >> ((level - 1) * PM_TIMER_WHEEL_BITS)) & PM_TIMER_WHEEL_MASK)
+                    break;
+                wheel_cascade(global, &global->wheel_[level][(ticks >> (level * PM_TIMER_WHEEL_BITS)) & PM_TIMER_WHEEL_MASK].list_);
+            }
+            if(level == PM_TIMER_WHEEL_LEVELS
+                && ((ticks >> ((level - 1) * PM_TIMER_WHEEL_BITS)) & PM_TIMER_WHEEL_MASK) == 0)
+                wheel_cascade(global, &global->timers_);
+        }
+    }
+#endif
+
     static void run(){
         timer_global *global = pm_timer::get_global();
 
         uint32_t current_ticks = pm_timer::get_ticks ();
 
+#ifdef PM_TIMER_WHEEL
+        pm_timer::wheel_run(global, current_ticks);
+#else
         pm_list *node = global->timers_.next();
         while(node != &global->timers_){
-            pm_memory_pool_buf_header *header = pm_container_of(node, &pm_memory_pool_buf_header::list_);
-            pm_timer *timer = reinterpret_cast<pm_timer *>(pm_memory_pool_buf_header::to_ptr(header));
+            pm_timer *timer = pm_timer::from_list(node);
 
             int32_t ticks_to_wakeup = (int32_t)(timer->wakeup_ticks_ - current_ticks);
 
             if(ticks_to_wakeup <= 0){
                 pm_list *node_next = node->next();
-                defer_list::attach(timer->defer_);
-                node->detach();
-                pm_delete(timer);
+                pm_timer::expire(node);
                 node = node_next;
             }
             else break;
         }
-    }
-    
-    static void kill__(Defer &defer){
-#ifdef PM_DEBUG
-        pm_assert(defer->type_ == PM_TYPE_TIMER);
 #endif
+    }
 
+    /* Ticks until the earliest timer expires, 0xFFFFFFFF if there's no timer.
+       For the timing wheel it may be earlier, when timers cascade down a level. */
+    static uint32_t next_timeout(){
         timer_global *global = pm_timer::get_global();
 
-        pm_list *node = global->timers_.next();
-        while(node != &global->timers_){
-            pm_memory_pool_buf_header *header = pm_container_of(node, &pm_memory_pool_buf_header::list_);
-            pm_timer *timer = reinterpret_cast<pm_timer *>(pm_memory_pool_buf_header::to_ptr(header));
+        uint32_t current_ticks = pm_timer::get_ticks ();
+#ifdef PM_TIMER_WHEEL
+        uint32_t base = global->wheel_ticks_;
+        uint64_t timeout = (uint64_t)0xFFFFFFFF + (current_ticks - base);
 
-            pm_list *node_next = node->next();
-            if(timer->defer_ == defer){
-                node->detach();
-                pm_delete(timer);
+        for(uint32_t i = 0; i < PM_TIMER_WHEEL_SLOTS; ++i){
+            if(!global->wheel_[0][(base + i) & PM_TIMER_WHEEL_MASK].list_.empty()){
+                timeout = i;
+                break;
+            }
+        }
+
+        /* Timers in upper levels can not expire before they cascade down */
+        for(size_t level = 1; level < PM_TIMER_WHEEL_LEVELS; ++level){
+            size_t shift = level * PM_TIMER_WHEEL_BITS;
+            uint64_t lap = (uint64_t)base >> shift;
+            for(uint32_t i = 1; i <= PM_TIMER_WHEEL_SLOTS; ++i){
+                if(!global->wheel_[level][(lap + i) & PM_TIMER_WHEEL_MASK].list_.empty()){
+                    uint64_t cascade = ((lap + i) << shift) - base;
+                    if(cascade < timeout) timeout = cascade;
+                    break;
+                }
             }
-            node = node_next;
         }
+        if(!global->timers_.empty()){
+            size_t shift = PM_TIMER_WHEEL_LEVELS * PM_TIMER_WHEEL_BITS;
+            uint64_t cascade = ((((uint64_t)base >> shift) + 1) << shift) - base;
+            if(cascade < timeout) timeout = cascade;
+        }
+
+        if(timeout <= (uint64_t)(current_ticks - base)) return 0;
+        timeout -= (current_ticks - base);
+        return (timeout > (uint64_t)0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)timeout);
+#else
+        if(global->timers_.empty()) return 0xFFFFFFFF;
+
+        pm_timer *timer = pm_timer::from_list(global->timers_.next());
+        int32_t ticks_to_wakeup = (int32_t)(timer->wakeup_ticks_ - current_ticks);
+        return (ticks_to_wakeup <= 0 ? 0 : (uint32_t)ticks_to_wakeup);
+#endif
+    }
+
+    /* The timer promise is linked in the timer list or the ready list, unlink it in O(1) */
+    static void kill__(Defer &defer){
+#ifdef PM_DEBUG
+        pm_assert(defer->type_ == PM_TYPE_TIMER);
+#endif
+        defer_list::remove(defer);
     }
 
     static void kill(Defer &defer){
@@ -131,7 +275,6 @@ struct pm_timer {
 
             if(no_ref->status_ == Promise::kInit){
                 pm_timer::kill__(no_ref);
-                defer_list::remove(no_ref);
                 no_ref.reject();
             }
         }
@@ -144,40 +287,45 @@ struct pm_timer {
 
             if(no_ref->status_ == Promise::kInit){
                 pm_timer::kill__(no_ref);
-                defer_list::remove(no_ref);
                 no_ref.resolve();
             }
         }
     }
 
-    //pm_timer(const Defer &defer)
-    //    : defer_(defer){
-    //}
     pm_timer()
-        : defer_(){
+        : wakeup_ticks_(0){
     }
 
+    inline Promise *get_promise();
+
     void start2(uint32_t ticks){
         timer_global *global = pm_timer::get_global();
 
         uint32_t current_ticks = pm_timer::get_ticks ();
         wakeup_ticks_ = current_ticks + ticks;
 
+        Promise *promise = get_promise();
+        pm_list *list = &promise->list_;
+        if(!list->empty())
+            list->detach();
+        else{
+            /* The timer list holds a reference of the promise until expired or killed */
+            pm_allocator::add_ref(promise);
+        }
+
+#ifdef PM_TIMER_WHEEL
+        pm_timer::wheel_insert(global, list, wakeup_ticks_);
+#else
         pm_list *node = global->timers_.next();
         for(; node != &global->timers_; node = node->next()){
-            pm_memory_pool_buf_header *header = pm_container_of(node, &pm_memory_pool_buf_header::list_);
-            pm_timer *timer = reinterpret_cast<pm_timer *>(pm_memory_pool_buf_header::to_ptr(header));
+            pm_timer *timer = pm_timer::from_list(node);
             int32_t ticks_to_wakeup = (int32_t)(timer->wakeup_ticks_ - current_ticks);
             if (ticks_to_wakeup >= 0 && (uint32_t)ticks_to_wakeup > ticks)
                 break;
         }
 
-        pm_memory_pool_buf_header *header = pm_memory_pool_buf_header::from_ptr(this);
-        pm_list *list = &header->list_;
-        pm_assert(header->ref_count_ > 0);
-        if(!list->empty())
-            list->detach();
         node->attach(list);
+#endif
     }
 
     void start(uint32_t msec){
@@ -186,18 +334,116 @@ struct pm_timer {
 
 //private:
     uint32_t wakeup_ticks_;
-    Defer defer_;
 };
 
+/* Timer is embedded in the promise returned by delay_ticks() and linked by
+   Promise::list_, so kill_timer() finds it from the Defer object directly. */
+struct TimerPromise
+    : public Promise {
+    pm_timer timer_;
+
+    TimerPromise()
+        : Promise()
+        , timer_(){
+    }
+};
+
+inline pm_timer *pm_timer::from_list(pm_list *node){
+    return &static_cast<TimerPromise *>(defer_list::from_list(node))->timer_;
+}
+
+inline Promise *pm_timer::get_promise(){
+    return pm_container_of(this, &TimerPromise::timer_);
+}
+
+inline pm_timer *pm_timer::from_defer(const Defer &defer){
+    return &static_cast<TimerPromise *>(defer.operator->())->timer_;
+}
+
+#ifdef SysTick
+/* SysTick as clock source of pm_idle(), the periodic tick set by
+   pm_timer::init_system() is stopped and SysTick counts down once to the timeout. */
+struct pm_systick_clock {
+    struct state {
+        uint32_t cycles_;       /* cycles per tick */
+        uint32_t first_;        /* cycles to the first tick boundary */
+        uint32_t ticks_;        /* ticks programmed */
+        uint32_t pending_;      /* tick pending when suspended */
+    };
+    static state *get_state(){
+        static state state_;
+        return &state_;
+    }
+
+    static uint32_t suspend(uint32_t ticks){
+        state *st = get_state();
+        SysTick->CTRL &= ~SysTick_CTRL_ENABLE_Msk;
+
+        st->cycles_ = SysTick->LOAD + 1;
+        st->first_ = SysTick->VAL;
+        if(st->first_ == 0) st->first_ = st->cycles_;
+
+        /* The periodic tick expired but its handler is masked */
+        st->pending_ = 0;
+        if(SCB->ICSR & SCB_ICSR_PENDSTSET_Msk){
+            SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+            st->pending_ = 1;
+        }
+
+        uint32_t max_ticks = (SysTick_LOAD_RELOAD_Msk + 1) / st->cycles_;
+        if(ticks > max_ticks) ticks = max_ticks;
+        if(ticks == 0) ticks = 1;
+        st->ticks_ = ticks;
+
+        SysTick->LOAD = st->first_ + (ticks - 1) * st->cycles_ - 1;
+        SysTick->VAL = 0;
+        SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+        return ticks;
+    }
+
+    static uint32_t resume(){
+        state *st = get_state();
+        uint32_t ctrl = SysTick->CTRL;
+        SysTick->CTRL = ctrl & ~SysTick_CTRL_ENABLE_Msk;
+
+        /* Cycles since the programmed period started, or since it expired
+           and reloaded, through the wakeup and the return to here */
+        uint32_t passed = SysTick->LOAD + 1 - SysTick->VAL;
+        uint32_t ticks = 0;
+        uint32_t first = st->first_;
+        if(ctrl & SysTick_CTRL_COUNTFLAG_Msk){
+            /* Timeout, the tick handler must not count it again */
+            SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+            ticks = st->ticks_;
+            first = st->cycles_;
+        }
+
+        uint32_t remain;
+        if(passed < first){
+            remain = first - passed;
+        }
+        else{
+            ticks += 1 + (passed - first) / st->cycles_;
+            remain = st->cycles_ - (passed - first) % st->cycles_;
+        }
+
+        /* Finish the current tick, then reload the periodic tick */
+        SysTick->LOAD = remain - 1;
+        SysTick->VAL = 0;
+        SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+        SysTick->LOAD = st->cycles_ - 1;
+        return ticks + st->pending_;
+    }
+};
+#endif
+
 inline Defer delay_ticks(uint32_t ticks) {
-    pm_timer *timer = pm_new<pm_timer>();
-    return newPromise([ticks, timer](const Defer &d){
+    Defer d(pm_new<TimerPromise>());
 #ifdef PM_DEBUG
-        d->type_ = PM_TYPE_TIMER;
+    d->type_ = PM_TYPE_TIMER;
 #endif
-        timer->defer_ = d;
-        timer->start2(ticks);
-    });
+    pm_timer::from_defer(d)->start2(ticks);
+    return d;
 }
 
 inline Defer delay_ms(uint32_t msec) {